@@ -0,0 +1,42 @@
+/*
+ * SIMD kernels for the addalpha element
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef ADDALPHASIMD_H
+#define ADDALPHASIMD_H
+
+#include <glib.h>
+
+/* Pixels handled by one iteration of the kernels */
+#define ADD_ALPHA_SIMD_BLOCK 32
+
+/* Interleave n_pixels packed 24-bit pixels from frame with the 8-bit alpha
+ * values from mask into 32-bit pixels in dest, alpha first. Only whole
+ * blocks are processed, so the number of processed pixels is returned and
+ * the rest is left to the caller.
+ */
+typedef gint (*AddAlphaSimdFunc) (const guint8 *frame,
+                                  const guint8 *mask,
+                                  guint8       *dest,
+                                  gint          n_pixels);
+
+/* Returns the best kernel the CPU supports, or NULL if there is none */
+AddAlphaSimdFunc add_alpha_simd_get_func (const gchar **name);
+
+#endif
@@ -27,6 +27,15 @@
  * conversion is done, therefore if working with RGB, it should be 24 bpp,
  * and in the case of YUV, it must be a raw 4:4:4 packed pixel format.
  *
+ * Planar I420 frames are also accepted, and are output as A420. Since that
+ * is I420 with an additional full resolution alpha plane, the frame and the
+ * mask are copied plane by plane instead of being interleaved, and when the
+ * two input buffers already lie back to back in memory, the output buffer
+ * simply spans them without copying at all.
+ *
+ * Where the CPU supports SSSE3 or AVX2, the pixels and alpha values are
+ * interleaved with byte shuffles, many pixels at a time.
+ *
  * <refsect2>
  * <title>Example launch line</title>
  * |[
@@ -40,7 +49,9 @@
 #include <gst/gst.h>
 #include <gst/base/gstcollectpads.h>
 #include <glib.h>
+#include <string.h>
 #include "gstaddalpha.h"
+#include "addalphasimd.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_add_alpha_debug);
 #define GST_CAT_DEFAULT gst_add_alpha_debug
@@ -67,7 +78,7 @@ GST_STATIC_PAD_TEMPLATE ("fsink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("video/x-raw-yuv,"
-        "format=(fourcc)v308; "
+        "format=(fourcc){ v308, I420 }; "
         "video/x-raw-rgb,"
         "depth=24,"
         "bpp=24")
@@ -87,7 +98,7 @@ GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("video/x-raw-yuv,"
-        "format=(fourcc)AYUV; "
+        "format=(fourcc){ AYUV, A420 }; "
         "video/x-raw-rgb,"
         "bpp=32,"
         "depth=32")
@@ -112,6 +123,58 @@ static gboolean
 gst_add_alpha_set_src_caps(GstPad * pad, GstCaps * caps);
 static GstStateChangeReturn
 gst_add_alpha_change_state(GstElement *element, GstStateChange transition);
+/* Planar A420 output is laid out as an I420 frame followed by an alpha
+ * plane with the same row stride as a gray mask frame. Returns the total
+ * size, and the size of the I420 part and the alpha row stride. */
+static guint
+gst_add_alpha_a420_layout(gint width, gint height, guint *yuv_size,
+    guint *alpha_stride)
+{
+  guint y_stride = GST_ROUND_UP_4 (width);
+  guint uv_stride = GST_ROUND_UP_4 (GST_ROUND_UP_2 (width) / 2);
+  guint rows = GST_ROUND_UP_2 (height);
+
+  *yuv_size = y_stride * rows + uv_stride * rows;
+  *alpha_stride = y_stride;
+
+  return *yuv_size + *alpha_stride * rows;
+}
+
+/* Planar output: the frame planes and the mask are copied as they are,
+ * with a NULL frame or mask standing for an EOS pad, as above */
+static void
+gst_add_alpha_repack_planar(const guint8 *framedata, const guint8 *maskdata,
+    guint8 *destdata, gint width, gint height)
+{
+  guint yuv_size, alpha_stride;
+  guint8 *alphadata;
+
+  gst_add_alpha_a420_layout (width, height, &yuv_size, &alpha_stride);
+  alphadata = destdata + yuv_size;
+
+  if (framedata == NULL) {
+    /* All zero bytes, as in the packed formats */
+    memset (destdata, GST_ADDALPHA_FULLY_TRANSPARENT,
+        yuv_size + alpha_stride * GST_ROUND_UP_2 (height));
+    return;
+  }
+
+  memcpy (destdata, framedata, yuv_size);
+
+  if (maskdata == NULL) {
+    memset (alphadata, GST_ADDALPHA_FULLY_OPAQUE,
+        alpha_stride * GST_ROUND_UP_2 (height));
+    return;
+  }
+
+  memcpy (alphadata, maskdata, alpha_stride * height);
+  /* The alpha plane is padded to an even number of rows like the luma */
+  if (height & 1) {
+    memcpy (alphadata + alpha_stride * height,
+        alphadata + alpha_stride * (height - 1), alpha_stride);
+  }
+}
+
 static GstFlowReturn
 gst_add_alpha_collect_func(GstCollectPads *pads, gpointer user_data);
 static gboolean
@@ -119,6 +182,9 @@ gst_add_alpha_sink_event (GstPad  *pad, GstEvent *event);
 static gboolean
 gst_add_alpha_src_event (GstPad  *pad, GstEvent *event);
 
+/* Vectorized interleave, NULL if the CPU has no support */
+static AddAlphaSimdFunc add_alpha_simd = NULL;
+
 /* GObject vmethod implementations */
 
 static void
@@ -153,6 +219,13 @@ gst_add_alpha_class_init(GstAddAlphaClass * klass)
   gobject_class->get_property = gst_add_alpha_get_property;
   gobject_class->finalize = gst_add_alpha_finalize;
 
+  {
+    const gchar *simd_name;
+
+    add_alpha_simd = add_alpha_simd_get_func (&simd_name);
+    GST_DEBUG ("using SIMD kernel: %s", simd_name);
+  }
+
   g_object_class_install_property(gobject_class, PROP_SILENT,
       g_param_spec_boolean("silent", "Silent", "Produce verbose output ?",
           FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
@@ -190,6 +263,7 @@ gst_add_alpha_init(GstAddAlpha * filter,
   /* Set up internal data */
 
   filter->width = filter->height = 0;
+  filter->planar = FALSE;
 
   /* Set up the CollectPads */
 
@@ -261,6 +335,7 @@ gst_add_alpha_set_frame_sink_caps(GstPad * pad, GstCaps * caps)
   const gchar *mimetype;
   gboolean ret;
   GstCaps *src_caps;
+  guint32 fourcc = 0;
 
   GstStructure *capstruct = gst_caps_get_structure(caps, 0);
 
@@ -269,6 +344,9 @@ gst_add_alpha_set_frame_sink_caps(GstPad * pad, GstCaps * caps)
   mimetype = gst_structure_get_name (capstruct);
   gst_structure_get_int(capstruct, "width", &filter->width);
   gst_structure_get_int(capstruct, "height", &filter->height);
+  gst_structure_get_fourcc(capstruct, "format", &fourcc);
+
+  filter->planar = (fourcc == GST_MAKE_FOURCC ('I', '4', '2', '0'));
 
   otherpad = filter->srcpad;
 
@@ -283,6 +361,8 @@ gst_add_alpha_set_frame_sink_caps(GstPad * pad, GstCaps * caps)
         "depth", G_TYPE_INT, 32,
         "alpha_mask", G_TYPE_INT, 0xff000000, NULL);
                         /* Alpha is always the first byte for now */
+  } else if (filter->planar) {
+    gst_caps_set_simple (src_caps, "format", GST_TYPE_FOURCC, GST_STR_FOURCC ("A420"), NULL);
   } else {
     gst_caps_set_simple (src_caps, "format", GST_TYPE_FOURCC, GST_STR_FOURCC ("AYUV"), NULL);
   }
@@ -305,6 +385,7 @@ gst_add_alpha_set_src_caps(GstPad * pad, GstCaps * caps)
   const gchar *mimetype;
   gboolean ret;
   GstCaps *fsink_caps;
+  guint32 fourcc = 0;
 
   GstStructure *capstruct = gst_caps_get_structure(caps, 0);
 
@@ -313,11 +394,16 @@ gst_add_alpha_set_src_caps(GstPad * pad, GstCaps * caps)
   mimetype = gst_structure_get_name (capstruct);
   gst_structure_get_int(capstruct, "width", &filter->width);
   gst_structure_get_int(capstruct, "height", &filter->height);
+  gst_structure_get_fourcc(capstruct, "format", &fourcc);
+
+  filter->planar = (fourcc == GST_MAKE_FOURCC ('A', '4', '2', '0'));
 
   otherpad = filter->framesink;
 
   if (g_strcmp0 (mimetype, "video/x-raw-rgb") == 0) {
     fsink_caps = gst_caps_new_simple ("video/x-raw-rgb", "bpp", G_TYPE_INT, 24, "depth", G_TYPE_INT, 24, NULL);
+  } else if (filter->planar) {
+    fsink_caps = gst_caps_new_simple ("video/x-raw-yuv", "format", GST_TYPE_FOURCC, GST_STR_FOURCC ("I420"), NULL);
   } else {
     fsink_caps = gst_caps_new_simple ("video/x-raw-yuv", "format", GST_TYPE_FOURCC, GST_STR_FOURCC ("v308"), NULL);
   }
@@ -367,16 +453,62 @@ gst_add_alpha_src_event (GstPad  *pad, GstEvent *event) {
    return ret;
 }
 
+/* Repacking, one routine for each combination of pads with data */
+
+/* Both pads have data: interleave frame pixels and mask values */
+static void
+gst_add_alpha_repack(const guint8 *framedata, const guint8 *maskdata,
+    guint8 *destdata, guint n_pixels)
+{
+  guint cur_pixel = 0;
+
+  /* Whole blocks are interleaved with byte shuffles */
+  if (add_alpha_simd) {
+    cur_pixel = add_alpha_simd (framedata, maskdata, destdata, n_pixels);
+  }
+
+  for (; cur_pixel < n_pixels; cur_pixel++) {
+    destdata[cur_pixel * 4] = maskdata[cur_pixel];
+    destdata[cur_pixel * 4 + 1] = framedata[cur_pixel * 3];
+    destdata[cur_pixel * 4 + 2] = framedata[cur_pixel * 3 + 1];
+    destdata[cur_pixel * 4 + 3] = framedata[cur_pixel * 3 + 2];
+  }
+}
+
+/* The mask pad is EOS: make the frame fully opaque */
+static void
+gst_add_alpha_repack_opaque(const guint8 *framedata, guint8 *destdata,
+    guint n_pixels)
+{
+  guint cur_pixel;
+
+  for (cur_pixel = 0; cur_pixel < n_pixels; cur_pixel++) {
+    destdata[cur_pixel * 4] = GST_ADDALPHA_FULLY_OPAQUE;
+    destdata[cur_pixel * 4 + 1] = framedata[cur_pixel * 3];
+    destdata[cur_pixel * 4 + 2] = framedata[cur_pixel * 3 + 1];
+    destdata[cur_pixel * 4 + 3] = framedata[cur_pixel * 3 + 2];
+  }
+}
+
+/* The frame pad is EOS: zero out the image and make it fully transparent */
+static void
+gst_add_alpha_repack_transparent(guint8 *destdata, guint n_pixels)
+{
+  /* Transparent black is all zero bytes */
+  memset (destdata, GST_ADDALPHA_FULLY_TRANSPARENT, n_pixels * 4);
+}
+
 static GstFlowReturn
 gst_add_alpha_collect_func(GstCollectPads *pads, gpointer user_data)
 {
   GstBuffer *framebuf = NULL, *maskbuf = NULL, *destbuf = NULL;
+  GstBuffer *metabuf;
   guint8 *framedata = NULL, *maskdata = NULL, *destdata = NULL;
 
   GstAddAlpha *filter;
 
   gint width, height;
-  guint cur_pixel;
+  guint dest_size, frame_size, mask_size, yuv_size = 0, alpha_stride = 0;
   gboolean frame_eos = FALSE, mask_eos = FALSE;
 
   GstFlowReturn buf_alloc_ret;
@@ -412,13 +544,62 @@ gst_add_alpha_collect_func(GstCollectPads *pads, gpointer user_data)
     return GST_FLOW_OK;
   }
 
+  /* Timestamps and offsets come from the frame, or the mask if the frame
+   * pad is EOS */
+  metabuf = framebuf ? framebuf : maskbuf;
+
+  if (filter->planar) {
+    dest_size = gst_add_alpha_a420_layout (width, height, &yuv_size,
+        &alpha_stride);
+    frame_size = yuv_size;
+    mask_size = alpha_stride * height;
+  } else {
+    dest_size = width*height*4;
+    frame_size = width*height*3;
+    mask_size = width*height;
+  }
+
+  /* The repacking reads whole frames, so short buffers can't be used */
+  if ((framebuf && GST_BUFFER_SIZE (framebuf) < frame_size) ||
+      (maskbuf && GST_BUFFER_SIZE (maskbuf) < mask_size)) {
+    GST_ELEMENT_ERROR (filter, STREAM, FORMAT, (NULL),
+        ("buffers too small for %dx%d: frame %u of %u, mask %u of %u bytes",
+            width, height, framebuf ? GST_BUFFER_SIZE (framebuf) : 0,
+            frame_size, maskbuf ? GST_BUFFER_SIZE (maskbuf) : 0, mask_size));
+
+    if (maskbuf) {
+      gst_buffer_unref(maskbuf);
+    }
+    if (framebuf) {
+      gst_buffer_unref(framebuf);
+    }
+
+    return GST_FLOW_ERROR;
+  }
+
+  /* If the mask directly follows the frame in memory, which also needs the
+   * height to be even, the A420 output is a view of both */
+  if (filter->planar && framebuf && maskbuf &&
+      GST_BUFFER_SIZE (framebuf) == yuv_size &&
+      GST_BUFFER_SIZE (maskbuf) == dest_size - yuv_size &&
+      gst_buffer_is_span_fast (framebuf, maskbuf)) {
+    GST_DEBUG ("frame and mask are contiguous, spanning them");
+
+    destbuf = gst_buffer_span (framebuf, 0, maskbuf, dest_size);
+    gst_buffer_copy_metadata (destbuf, framebuf, GST_BUFFER_COPY_TIMESTAMPS);
+    gst_buffer_set_caps (destbuf, GST_PAD_CAPS (filter->srcpad));
+
+    gst_buffer_unref(maskbuf);
+    gst_buffer_unref(framebuf);
+
+    return gst_pad_push(filter->srcpad, destbuf);
+  }
+
   /* Allocate output buffer. */
   buf_alloc_ret = gst_pad_alloc_buffer_and_set_caps(filter->srcpad,
-      GST_BUFFER_OFFSET (maskbuf), width*height*4,
+      GST_BUFFER_OFFSET (metabuf), dest_size,
       GST_PAD_CAPS (filter->srcpad), &destbuf);
 
-  GST_DEBUG ("width = %d, height = %d, req size = %u, act size = %u", width, height, width*height*4, GST_BUFFER_SIZE (destbuf));
-
   /* Handle errors */
   if (buf_alloc_ret != GST_FLOW_OK) {
     if (maskbuf) {
@@ -433,46 +614,28 @@ gst_add_alpha_collect_func(GstCollectPads *pads, gpointer user_data)
     return buf_alloc_ret;
   }
 
-  GST_BUFFER_TIMESTAMP (destbuf) = GST_BUFFER_TIMESTAMP (framebuf);
-  GST_BUFFER_DURATION (destbuf) = GST_BUFFER_DURATION (framebuf);
-  GST_BUFFER_OFFSET (destbuf) = GST_BUFFER_OFFSET (framebuf);
-  GST_BUFFER_OFFSET_END (destbuf) = GST_BUFFER_OFFSET_END (framebuf);
+  GST_DEBUG ("width = %d, height = %d, req size = %u, act size = %u", width, height, dest_size, GST_BUFFER_SIZE (destbuf));
 
-  destdata = GST_BUFFER_DATA (destbuf);
-
-  GST_DEBUG ("buffer sizes: frame %u, mask %u, dest %u", GST_BUFFER_SIZE (framebuf), GST_BUFFER_SIZE (maskbuf), GST_BUFFER_SIZE (destbuf));
-
-  /* Do the actual repacking */
-  for (cur_pixel = 0; cur_pixel < width*height; cur_pixel++) {
-    /* If the frame pad is EOS, zero out the image and make it
-     * fully transparent. If the mask pad is EOS, make the frame
-     * fully opaque. Else, copy pixel and alpha data.
-     */
-    guint8 alpha_byte = GST_ADDALPHA_FULLY_TRANSPARENT;
-    guint8 pixel_data[3] = {0, 0, 0};
-
-    if (mask_eos) {
-      alpha_byte = GST_ADDALPHA_FULLY_OPAQUE;
-    } else {
-      alpha_byte = maskdata[cur_pixel];
-    }
+  GST_BUFFER_TIMESTAMP (destbuf) = GST_BUFFER_TIMESTAMP (metabuf);
+  GST_BUFFER_DURATION (destbuf) = GST_BUFFER_DURATION (metabuf);
+  GST_BUFFER_OFFSET (destbuf) = GST_BUFFER_OFFSET (metabuf);
+  GST_BUFFER_OFFSET_END (destbuf) = GST_BUFFER_OFFSET_END (metabuf);
 
-    /* If mask_eos, there can't be frame_eos, b/c we handle that earlier,
-     * so this is run in the normal case and mask_eos too.
-     */
-    if (!frame_eos) {
-      pixel_data[0] = framedata[cur_pixel * 3];
-      pixel_data[1] = framedata[cur_pixel * 3 + 1];
-      pixel_data[2] = framedata[cur_pixel * 3 + 2];
-    }
-
-    /* If frame_eos, alpha_byte and pixel_data remain default */
+  destdata = GST_BUFFER_DATA (destbuf);
 
-    destdata[cur_pixel * 4] = alpha_byte; /* Copy alpha byte */
-    /* Copy pixel data */
-    destdata[cur_pixel * 4 + 1] = pixel_data[0];
-    destdata[cur_pixel * 4 + 2] = pixel_data[1];
-    destdata[cur_pixel * 4 + 3] = pixel_data[2];
+  GST_DEBUG ("buffer sizes: frame %u, mask %u, dest %u",
+      framebuf ? GST_BUFFER_SIZE (framebuf) : 0,
+      maskbuf ? GST_BUFFER_SIZE (maskbuf) : 0, GST_BUFFER_SIZE (destbuf));
+
+  /* Do the actual repacking. Both pads being EOS was handled earlier. */
+  if (filter->planar) {
+    gst_add_alpha_repack_planar (framedata, maskdata, destdata, width, height);
+  } else if (frame_eos) {
+    gst_add_alpha_repack_transparent (destdata, width*height);
+  } else if (mask_eos) {
+    gst_add_alpha_repack_opaque (framedata, destdata, width*height);
+  } else {
+    gst_add_alpha_repack (framedata, maskdata, destdata, width*height);
   }
 
   if (maskbuf) {
@@ -53,6 +53,9 @@ struct _GstAddAlpha
 
   gint width, height;
 
+  /* I420 in, A420 out: the planes are copied rather than interleaved */
+  gboolean planar;
+
   gboolean silent;
 
 };
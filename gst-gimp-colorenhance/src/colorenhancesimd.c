@@ -0,0 +1,364 @@
+/*
+ * SIMD kernels for the GIMP color enhancement filter
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* The scalar path subtracts K from the CMY components before converting to
+ * HSV, so the smallest component of the map is always 0. This simplifies the
+ * conversion a lot: V is the difference of the largest and smallest RGB
+ * component, S is 255 unless V is 0, and on the way back P is 0, Q is
+ * V * (59 - f) / 59 and T is V * f / 59. Adding K back and inverting gives
+ * max(0, max(R, G, B) - map) for each channel.
+ *
+ * The kernels work on 32-bit lanes, and do the integer divisions as single
+ * precision divisions truncated toward zero. This is exact here: every
+ * quotient is at most 65025 / d in magnitude, so the rounding error of the
+ * division stays below 1 / d, which is the smallest distance of a non-integer
+ * quotient from an integer.
+ */
+
+#include "colorenhancesimd.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+/* SSE4.1 kernel, 4 pixels per vector */
+
+#define SSE41 __attribute__ ((target ("sse4.1")))
+
+static inline SSE41 __m128i
+div_trunc_sse41 (__m128i n, __m128 d)
+{
+  return _mm_cvttps_epi32 (_mm_div_ps (_mm_cvtepi32_ps (n), d));
+}
+
+static inline SSE41 __m128i
+mul_const_sse41 (__m128i a, gint c)
+{
+  return _mm_mullo_epi32 (a, _mm_set1_epi32 (c));
+}
+
+static inline SSE41 void
+enhance_vector_sse41 (__m128i *r, __m128i *g, __m128i *b, gboolean stretch,
+    __m128i vlo, __m128i vhi, __m128 vrange)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i max, min, v, vs, case_r, case_g, d, off, h, hue, sector, f, q, t;
+  __m128i s0, s1, s2, s3, s4, s5, mr, mg, mb, gray;
+
+  max = _mm_max_epi32 (*r, _mm_max_epi32 (*g, *b));
+  min = _mm_min_epi32 (*r, _mm_min_epi32 (*g, *b));
+  v = _mm_sub_epi32 (max, min);
+
+  if (stretch)
+    vs = div_trunc_sse41 (mul_const_sse41 (_mm_sub_epi32 (
+                _mm_min_epi32 (_mm_max_epi32 (v, vlo), vhi), vlo), 255),
+        vrange);
+  else
+    vs = v;
+
+  /* Hue, checking the components in the same order as gimp_rgb_to_hsv4 */
+  case_r = _mm_cmpeq_epi32 (*r, min);
+  case_g = _mm_andnot_si128 (case_r, _mm_cmpeq_epi32 (*g, min));
+  d = _mm_blendv_epi8 (_mm_sub_epi32 (*g, *r), _mm_sub_epi32 (*r, *b),
+      case_g);
+  d = _mm_blendv_epi8 (d, _mm_sub_epi32 (*b, *g), case_r);
+  off = _mm_blendv_epi8 (_mm_set1_epi32 (1020), _mm_set1_epi32 (510), case_g);
+  off = _mm_blendv_epi8 (off, zero, case_r);
+
+  h = _mm_add_epi32 (off, div_trunc_sse41 (mul_const_sse41 (d, 255),
+          _mm_cvtepi32_ps (_mm_max_epi32 (v, _mm_set1_epi32 (1)))));
+  h = div_trunc_sse41 (mul_const_sse41 (h, 60), _mm_set1_ps (255.0f));
+  h = _mm_add_epi32 (h, _mm_and_si128 (_mm_cmpgt_epi32 (zero, h),
+          _mm_set1_epi32 (360)));
+  hue = div_trunc_sse41 (mul_const_sse41 (h, 255), _mm_set1_ps (360.0f));
+
+  /* And back */
+  h = div_trunc_sse41 (mul_const_sse41 (hue, 360), _mm_set1_ps (255.0f));
+  sector = div_trunc_sse41 (h, _mm_set1_ps (60.0f));
+  f = _mm_sub_epi32 (h, mul_const_sse41 (sector, 60));
+  q = div_trunc_sse41 (_mm_mullo_epi32 (vs,
+          _mm_sub_epi32 (_mm_set1_epi32 (59), f)), _mm_set1_ps (59.0f));
+  t = div_trunc_sse41 (_mm_mullo_epi32 (vs, f), _mm_set1_ps (59.0f));
+
+  s0 = _mm_cmpeq_epi32 (sector, zero);
+  s1 = _mm_cmpeq_epi32 (sector, _mm_set1_epi32 (1));
+  s2 = _mm_cmpeq_epi32 (sector, _mm_set1_epi32 (2));
+  s3 = _mm_cmpeq_epi32 (sector, _mm_set1_epi32 (3));
+  s4 = _mm_cmpeq_epi32 (sector, _mm_set1_epi32 (4));
+  s5 = _mm_cmpeq_epi32 (sector, _mm_set1_epi32 (5));
+
+  mr = _mm_or_si128 (_mm_and_si128 (_mm_or_si128 (s0, s5), vs),
+      _mm_or_si128 (_mm_and_si128 (s1, q), _mm_and_si128 (s4, t)));
+  mg = _mm_or_si128 (_mm_and_si128 (_mm_or_si128 (s1, s2), vs),
+      _mm_or_si128 (_mm_and_si128 (s0, t), _mm_and_si128 (s3, q)));
+  mb = _mm_or_si128 (_mm_and_si128 (_mm_or_si128 (s3, s4), vs),
+      _mm_or_si128 (_mm_and_si128 (s2, t), _mm_and_si128 (s5, q)));
+
+  /* Gray pixels have no saturation, all components get V */
+  gray = _mm_cmpeq_epi32 (v, zero);
+  mr = _mm_blendv_epi8 (mr, vs, gray);
+  mg = _mm_blendv_epi8 (mg, vs, gray);
+  mb = _mm_blendv_epi8 (mb, vs, gray);
+
+  *r = _mm_max_epi32 (_mm_sub_epi32 (max, mr), zero);
+  *g = _mm_max_epi32 (_mm_sub_epi32 (max, mg), zero);
+  *b = _mm_max_epi32 (_mm_sub_epi32 (max, mb), zero);
+}
+
+/* Reads 16 bytes, writes 12 */
+static inline SSE41 void
+enhance_4_sse41 (const guint8 *src, guint8 *dest, gboolean stretch,
+    __m128i vlo, __m128i vhi, __m128 vrange)
+{
+  const __m128i shuf_r = _mm_setr_epi8 (0, -1, -1, -1, 3, -1, -1, -1,
+      6, -1, -1, -1, 9, -1, -1, -1);
+  const __m128i shuf_g = _mm_setr_epi8 (1, -1, -1, -1, 4, -1, -1, -1,
+      7, -1, -1, -1, 10, -1, -1, -1);
+  const __m128i shuf_b = _mm_setr_epi8 (2, -1, -1, -1, 5, -1, -1, -1,
+      8, -1, -1, -1, 11, -1, -1, -1);
+  const __m128i shuf_out = _mm_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9, 10,
+      12, 13, 14, -1, -1, -1, -1);
+  __m128i in, r, g, b, out;
+  guint32 last;
+
+  in = _mm_loadu_si128 ((const __m128i *) src);
+  r = _mm_shuffle_epi8 (in, shuf_r);
+  g = _mm_shuffle_epi8 (in, shuf_g);
+  b = _mm_shuffle_epi8 (in, shuf_b);
+
+  enhance_vector_sse41 (&r, &g, &b, stretch, vlo, vhi, vrange);
+
+  out = _mm_or_si128 (r, _mm_or_si128 (_mm_slli_epi32 (g, 8),
+          _mm_slli_epi32 (b, 16)));
+  out = _mm_shuffle_epi8 (out, shuf_out);
+  _mm_storel_epi64 ((__m128i *) dest, out);
+  last = _mm_extract_epi32 (out, 2);
+  memcpy (dest + 8, &last, 4);
+}
+
+static SSE41 gint
+color_enhance_sse41 (const guint8 *src, guint8 *dest, gint n_pixels,
+    guint8 vlo, guint8 vhi)
+{
+  gboolean stretch = (vhi != vlo);
+  __m128i vlo_v = _mm_set1_epi32 (vlo);
+  __m128i vhi_v = _mm_set1_epi32 (vhi);
+  __m128 vrange = _mm_set1_ps ((gfloat) vhi - vlo);
+  gint i;
+
+  /* Keep two pixels after the block for the overlong last load */
+  for (i = 0; i + COLOR_ENHANCE_SIMD_BLOCK + 2 <= n_pixels;
+      i += COLOR_ENHANCE_SIMD_BLOCK) {
+    gint o = i * 3;
+
+    enhance_4_sse41 (src + o, dest + o, stretch, vlo_v, vhi_v,
+        vrange);
+    enhance_4_sse41 (src + o + 12, dest + o + 12, stretch, vlo_v, vhi_v,
+        vrange);
+    enhance_4_sse41 (src + o + 24, dest + o + 24, stretch, vlo_v, vhi_v,
+        vrange);
+    enhance_4_sse41 (src + o + 36, dest + o + 36, stretch, vlo_v, vhi_v,
+        vrange);
+  }
+
+  return i;
+}
+
+/* AVX2 kernel, 8 pixels per vector */
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+static inline AVX2 __m256i
+div_trunc_avx2 (__m256i n, __m256 d)
+{
+  return _mm256_cvttps_epi32 (_mm256_div_ps (_mm256_cvtepi32_ps (n), d));
+}
+
+static inline AVX2 __m256i
+mul_const_avx2 (__m256i a, gint c)
+{
+  return _mm256_mullo_epi32 (a, _mm256_set1_epi32 (c));
+}
+
+static inline AVX2 void
+enhance_vector_avx2 (__m256i *r, __m256i *g, __m256i *b, gboolean stretch,
+    __m256i vlo, __m256i vhi, __m256 vrange)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i max, min, v, vs, case_r, case_g, d, off, h, hue, sector, f, q, t;
+  __m256i s0, s1, s2, s3, s4, s5, mr, mg, mb, gray;
+
+  max = _mm256_max_epi32 (*r, _mm256_max_epi32 (*g, *b));
+  min = _mm256_min_epi32 (*r, _mm256_min_epi32 (*g, *b));
+  v = _mm256_sub_epi32 (max, min);
+
+  if (stretch)
+    vs = div_trunc_avx2 (mul_const_avx2 (_mm256_sub_epi32 (
+                _mm256_min_epi32 (_mm256_max_epi32 (v, vlo), vhi), vlo), 255),
+        vrange);
+  else
+    vs = v;
+
+  case_r = _mm256_cmpeq_epi32 (*r, min);
+  case_g = _mm256_andnot_si256 (case_r, _mm256_cmpeq_epi32 (*g, min));
+  d = _mm256_blendv_epi8 (_mm256_sub_epi32 (*g, *r),
+      _mm256_sub_epi32 (*r, *b), case_g);
+  d = _mm256_blendv_epi8 (d, _mm256_sub_epi32 (*b, *g), case_r);
+  off = _mm256_blendv_epi8 (_mm256_set1_epi32 (1020),
+      _mm256_set1_epi32 (510), case_g);
+  off = _mm256_blendv_epi8 (off, zero, case_r);
+
+  h = _mm256_add_epi32 (off, div_trunc_avx2 (mul_const_avx2 (d, 255),
+          _mm256_cvtepi32_ps (_mm256_max_epi32 (v, _mm256_set1_epi32 (1)))));
+  h = div_trunc_avx2 (mul_const_avx2 (h, 60), _mm256_set1_ps (255.0f));
+  h = _mm256_add_epi32 (h, _mm256_and_si256 (_mm256_cmpgt_epi32 (zero, h),
+          _mm256_set1_epi32 (360)));
+  hue = div_trunc_avx2 (mul_const_avx2 (h, 255), _mm256_set1_ps (360.0f));
+
+  h = div_trunc_avx2 (mul_const_avx2 (hue, 360), _mm256_set1_ps (255.0f));
+  sector = div_trunc_avx2 (h, _mm256_set1_ps (60.0f));
+  f = _mm256_sub_epi32 (h, mul_const_avx2 (sector, 60));
+  q = div_trunc_avx2 (_mm256_mullo_epi32 (vs,
+          _mm256_sub_epi32 (_mm256_set1_epi32 (59), f)),
+      _mm256_set1_ps (59.0f));
+  t = div_trunc_avx2 (_mm256_mullo_epi32 (vs, f), _mm256_set1_ps (59.0f));
+
+  s0 = _mm256_cmpeq_epi32 (sector, zero);
+  s1 = _mm256_cmpeq_epi32 (sector, _mm256_set1_epi32 (1));
+  s2 = _mm256_cmpeq_epi32 (sector, _mm256_set1_epi32 (2));
+  s3 = _mm256_cmpeq_epi32 (sector, _mm256_set1_epi32 (3));
+  s4 = _mm256_cmpeq_epi32 (sector, _mm256_set1_epi32 (4));
+  s5 = _mm256_cmpeq_epi32 (sector, _mm256_set1_epi32 (5));
+
+  mr = _mm256_or_si256 (_mm256_and_si256 (_mm256_or_si256 (s0, s5), vs),
+      _mm256_or_si256 (_mm256_and_si256 (s1, q), _mm256_and_si256 (s4, t)));
+  mg = _mm256_or_si256 (_mm256_and_si256 (_mm256_or_si256 (s1, s2), vs),
+      _mm256_or_si256 (_mm256_and_si256 (s0, t), _mm256_and_si256 (s3, q)));
+  mb = _mm256_or_si256 (_mm256_and_si256 (_mm256_or_si256 (s3, s4), vs),
+      _mm256_or_si256 (_mm256_and_si256 (s2, t), _mm256_and_si256 (s5, q)));
+
+  gray = _mm256_cmpeq_epi32 (v, zero);
+  mr = _mm256_blendv_epi8 (mr, vs, gray);
+  mg = _mm256_blendv_epi8 (mg, vs, gray);
+  mb = _mm256_blendv_epi8 (mb, vs, gray);
+
+  *r = _mm256_max_epi32 (_mm256_sub_epi32 (max, mr), zero);
+  *g = _mm256_max_epi32 (_mm256_sub_epi32 (max, mg), zero);
+  *b = _mm256_max_epi32 (_mm256_sub_epi32 (max, mb), zero);
+}
+
+/* Reads 28 bytes, writes 24. Each 128-bit lane holds 4 pixels. */
+static inline AVX2 void
+enhance_8_avx2 (const guint8 *src, guint8 *dest, gboolean stretch,
+    __m256i vlo, __m256i vhi, __m256 vrange)
+{
+  const __m256i shuf_r = _mm256_setr_epi8 (0, -1, -1, -1, 3, -1, -1, -1,
+      6, -1, -1, -1, 9, -1, -1, -1, 0, -1, -1, -1, 3, -1, -1, -1,
+      6, -1, -1, -1, 9, -1, -1, -1);
+  const __m256i shuf_g = _mm256_setr_epi8 (1, -1, -1, -1, 4, -1, -1, -1,
+      7, -1, -1, -1, 10, -1, -1, -1, 1, -1, -1, -1, 4, -1, -1, -1,
+      7, -1, -1, -1, 10, -1, -1, -1);
+  const __m256i shuf_b = _mm256_setr_epi8 (2, -1, -1, -1, 5, -1, -1, -1,
+      8, -1, -1, -1, 11, -1, -1, -1, 2, -1, -1, -1, 5, -1, -1, -1,
+      8, -1, -1, -1, 11, -1, -1, -1);
+  const __m256i shuf_out = _mm256_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9, 10,
+      12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10,
+      12, 13, 14, -1, -1, -1, -1);
+  __m256i in, r, g, b, out;
+  __m128i half;
+  guint32 last;
+
+  in = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+          _mm_loadu_si128 ((const __m128i *) src)),
+      _mm_loadu_si128 ((const __m128i *) (src + 12)), 1);
+  r = _mm256_shuffle_epi8 (in, shuf_r);
+  g = _mm256_shuffle_epi8 (in, shuf_g);
+  b = _mm256_shuffle_epi8 (in, shuf_b);
+
+  enhance_vector_avx2 (&r, &g, &b, stretch, vlo, vhi, vrange);
+
+  out = _mm256_or_si256 (r, _mm256_or_si256 (_mm256_slli_epi32 (g, 8),
+          _mm256_slli_epi32 (b, 16)));
+  out = _mm256_shuffle_epi8 (out, shuf_out);
+
+  half = _mm256_castsi256_si128 (out);
+  _mm_storel_epi64 ((__m128i *) dest, half);
+  last = _mm_extract_epi32 (half, 2);
+  memcpy (dest + 8, &last, 4);
+
+  half = _mm256_extracti128_si256 (out, 1);
+  _mm_storel_epi64 ((__m128i *) (dest + 12), half);
+  last = _mm_extract_epi32 (half, 2);
+  memcpy (dest + 20, &last, 4);
+}
+
+static AVX2 gint
+color_enhance_avx2 (const guint8 *src, guint8 *dest, gint n_pixels,
+    guint8 vlo, guint8 vhi)
+{
+  gboolean stretch = (vhi != vlo);
+  __m256i vlo_v = _mm256_set1_epi32 (vlo);
+  __m256i vhi_v = _mm256_set1_epi32 (vhi);
+  __m256 vrange = _mm256_set1_ps ((gfloat) vhi - vlo);
+  gint i;
+
+  for (i = 0; i + COLOR_ENHANCE_SIMD_BLOCK + 2 <= n_pixels;
+      i += COLOR_ENHANCE_SIMD_BLOCK) {
+    gint o = i * 3;
+
+    enhance_8_avx2 (src + o, dest + o, stretch, vlo_v, vhi_v,
+        vrange);
+    enhance_8_avx2 (src + o + 24, dest + o + 24, stretch, vlo_v, vhi_v,
+        vrange);
+  }
+
+  return i;
+}
+
+ColorEnhanceSimdFunc
+color_enhance_simd_get_func (const gchar **name)
+{
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2")) {
+    *name = "avx2";
+    return color_enhance_avx2;
+  }
+
+  if (__builtin_cpu_supports ("sse4.1")) {
+    *name = "sse4.1";
+    return color_enhance_sse41;
+  }
+
+  *name = "none";
+  return NULL;
+}
+
+#else
+
+ColorEnhanceSimdFunc
+color_enhance_simd_get_func (const gchar **name)
+{
+  *name = "none";
+  return NULL;
+}
+
+#endif
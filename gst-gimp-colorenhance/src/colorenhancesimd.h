@@ -0,0 +1,45 @@
+/*
+ * SIMD kernels for the GIMP color enhancement filter
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef COLORENHANCESIMD_H
+#define COLORENHANCESIMD_H
+
+#include <glib.h>
+
+/* Pixels handled by one iteration of the kernels */
+#define COLOR_ENHANCE_SIMD_BLOCK 16
+
+/* Convert packed RGB pixels from src to HSV through CMYK, stretch V from
+ * [vlo, vhi] to [0, 255], clamping values outside of the range, and convert
+ * back to dest, which may be the same as
+ * src. The result is bit-exact with the scalar conversion functions. Only
+ * whole blocks are processed, and a few pixels past the last block are read,
+ * so the number of processed pixels is returned and the rest is left to the
+ * caller.
+ */
+typedef gint (*ColorEnhanceSimdFunc) (const guint8 *src,
+                                      guint8       *dest,
+                                      gint          n_pixels,
+                                      guint8        vlo,
+                                      guint8        vhi);
+
+/* Returns the best kernel the CPU supports, or NULL if there is none */
+ColorEnhanceSimdFunc color_enhance_simd_get_func (const gchar **name);
+
+#endif
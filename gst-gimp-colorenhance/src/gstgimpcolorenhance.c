@@ -30,7 +30,47 @@
  * First, the RGB-HSV color space conversion algorithms were converted to use
  * integers only, for increased performance. Second, efficiency was further
  * improved by splitting color space conversion from the enhancement itself.
- * This makes it possible to remove a redundant conversion pass.
+ * This makes it possible to remove a redundant conversion pass. The value
+ * range is found in a first pass without converting, and the second pass
+ * converts, enhances and converts back each pixel in turn, so no intermediate
+ * HSV frame is needed.
+ *
+ * On x86 CPUs with SSE4.1 or AVX2, the second pass runs a vectorized kernel,
+ * chosen at runtime, that gives the same results as the scalar code.
+ *
+ * For live and preview pipelines, stats-source can be set to previous. Each
+ * frame is then enhanced with the value range of the frame before it, and its
+ * own range is measured in the same pass, chunk by chunk. If the range jumps
+ * by more than scene-cut-threshold, as it does at scene cuts, the frame is
+ * enhanced again with its own range.
+ *
+ * The value range is read from a histogram of V. By default it spans from the
+ * smallest to the largest value, as in The GIMP, but low-percentile and
+ * high-percentile can be set to ignore a few outliers at either end. Values
+ * outside of the range are clipped. On large frames, stats-stride can be set
+ * to measure only a sparse grid of pixels.
+ *
+ * With the threads property set above 1, the frame is split into bands of
+ * rows. Each band is measured into its own histogram, the histograms are
+ * summed, and the bands are then enhanced in parallel, giving the same result
+ * as a single thread.
+ *
+ * Besides packed RGB, I420 and AYUV frames are accepted. These are converted
+ * to RGB and back pixel by pixel, with BT.601 fixed-point math, so decoded
+ * video doesn't need colorspace converters around the filter. In I420, the
+ * chroma of each 2x2 block is the average of the block's enhanced pixels.
+ *
+ * With a value range that stays the same over a shot, the transform is the
+ * same RGB to RGB function for every frame. The lut-mode property caches it:
+ * tetrahedral samples it on a 33x33x33 grid and interpolates, exact stores
+ * each computed color in a hash table. The LUTs of the last few ranges are
+ * kept.
+ *
+ * When a stream is rendered more than once, stats-file=analyze records the
+ * value range of each shot to stats-location, and stats-file=apply uses the
+ * recorded ranges in later runs instead of measuring the frames. Frames are
+ * matched by timestamp, so the results are the same in every run. The file
+ * is written at EOS, or when the element is stopped before that.
  *
  * The original description of the ported GIMP plugin "Color Enhance 0.10"
  * by Martin Weber and Federico Mena Quintero is the following.
@@ -58,9 +98,11 @@
 #endif
 
 #include <gst/gst.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "gstgimpcolorenhance.h"
+#include "colorenhancesimd.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_gimp_color_enhance_debug);
 #define GST_CAT_DEFAULT gst_gimp_color_enhance_debug
@@ -75,9 +117,84 @@ enum
 enum
 {
   PROP_0,
-  PROP_SILENT
+  PROP_SILENT,
+  PROP_STATS_SOURCE,
+  PROP_SCENE_CUT_THRESHOLD,
+  PROP_LOW_PERCENTILE,
+  PROP_HIGH_PERCENTILE,
+  PROP_THREADS,
+  PROP_STATS_STRIDE,
+  PROP_LUT_MODE,
+  PROP_STATS_FILE,
+  PROP_STATS_LOCATION
 };
 
+#define GST_TYPE_GIMP_COLOR_ENHANCE_LUT_MODE \
+  (gst_gimp_color_enhance_lut_mode_get_type ())
+static GType
+gst_gimp_color_enhance_lut_mode_get_type (void)
+{
+  static GType lut_mode_type = 0;
+  static const GEnumValue lut_modes[] = {
+    {GST_GIMP_COLOR_ENHANCE_LUT_NONE, "Compute every pixel", "none"},
+    {GST_GIMP_COLOR_ENHANCE_LUT_TETRAHEDRAL,
+        "Interpolate in a 33x33x33 LUT", "tetrahedral"},
+    {GST_GIMP_COLOR_ENHANCE_LUT_EXACT, "Cache computed colors", "exact"},
+    {0, NULL, NULL}
+  };
+
+  if (!lut_mode_type) {
+    lut_mode_type =
+        g_enum_register_static ("GstGimpColorEnhanceLutMode", lut_modes);
+  }
+  return lut_mode_type;
+}
+
+#define GST_TYPE_GIMP_COLOR_ENHANCE_STATS_FILE \
+  (gst_gimp_color_enhance_stats_file_get_type ())
+static GType
+gst_gimp_color_enhance_stats_file_get_type (void)
+{
+  static GType stats_file_type = 0;
+  static const GEnumValue stats_files[] = {
+    {GST_GIMP_COLOR_ENHANCE_STATS_FILE_OFF, "Don't use a statistics file",
+        "off"},
+    {GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE,
+        "Record the value ranges to the file", "analyze"},
+    {GST_GIMP_COLOR_ENHANCE_STATS_FILE_APPLY,
+        "Apply the value ranges from the file", "apply"},
+    {0, NULL, NULL}
+  };
+
+  if (!stats_file_type) {
+    stats_file_type =
+        g_enum_register_static ("GstGimpColorEnhanceStatsFile", stats_files);
+  }
+  return stats_file_type;
+}
+
+#define GST_TYPE_GIMP_COLOR_ENHANCE_STATS_SOURCE \
+  (gst_gimp_color_enhance_stats_source_get_type ())
+static GType
+gst_gimp_color_enhance_stats_source_get_type (void)
+{
+  static GType stats_source_type = 0;
+  static const GEnumValue stats_sources[] = {
+    {GST_GIMP_COLOR_ENHANCE_STATS_CURRENT,
+        "Measure the frame being enhanced", "current"},
+    {GST_GIMP_COLOR_ENHANCE_STATS_PREVIOUS,
+        "Use the range of the previous frame", "previous"},
+    {0, NULL, NULL}
+  };
+
+  if (!stats_source_type) {
+    stats_source_type =
+        g_enum_register_static ("GstGimpColorEnhanceStatsSource",
+        stats_sources);
+  }
+  return stats_source_type;
+}
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
@@ -85,13 +202,15 @@ enum
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("video/x-raw-rgb")
+    GST_STATIC_CAPS ("video/x-raw-rgb; "
+        "video/x-raw-yuv, format=(fourcc){ I420, AYUV }")
     );
 
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("video/x-raw-rgb")
+    GST_STATIC_CAPS ("video/x-raw-rgb; "
+        "video/x-raw-yuv, format=(fourcc){ I420, AYUV }")
     );
 
 GST_BOILERPLATE (GstGimpColorEnhance, gst_gimp_color_enhance, GstElement,
@@ -101,9 +220,21 @@ static void gst_gimp_color_enhance_set_property (GObject * object, guint prop_id
     const GValue * value, GParamSpec * pspec);
 static void gst_gimp_color_enhance_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_gimp_color_enhance_finalize (GObject * object);
 
 static gboolean gst_gimp_color_enhance_set_caps (GstPad * pad, GstCaps * caps);
 static GstFlowReturn gst_gimp_color_enhance_chain (GstPad * pad, GstBuffer * buf);
+static GstStateChangeReturn gst_gimp_color_enhance_change_state (
+    GstElement * element, GstStateChange transition);
+
+static void init_reciprocals (void);
+static void color_enhance_lut_free (gpointer data, gpointer user_data);
+static gboolean gst_gimp_color_enhance_sink_event (GstPad * pad,
+    GstEvent * event);
+static void gst_gimp_color_enhance_finish_stats (GstGimpColorEnhance * filter);
+
+/* Vectorized conversion and enhancement, NULL if the CPU has no support */
+static ColorEnhanceSimdFunc color_enhance_simd = NULL;
 
 /* GObject vmethod implementations */
 
@@ -136,10 +267,57 @@ gst_gimp_color_enhance_class_init (GstGimpColorEnhanceClass * klass)
 
   gobject_class->set_property = gst_gimp_color_enhance_set_property;
   gobject_class->get_property = gst_gimp_color_enhance_get_property;
+  gobject_class->finalize = gst_gimp_color_enhance_finalize;
+
+  gstelement_class->change_state = gst_gimp_color_enhance_change_state;
+
+  init_reciprocals ();
+
+  {
+    const gchar *simd_name;
+
+    color_enhance_simd = color_enhance_simd_get_func (&simd_name);
+    GST_DEBUG ("using SIMD kernel: %s", simd_name);
+  }
 
   g_object_class_install_property (gobject_class, PROP_SILENT,
       g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
           FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS_SOURCE,
+      g_param_spec_enum ("stats-source", "Statistics source", "Frame the value range is measured on. With previous, each frame is enhanced with the range of the one before it, while its own range is measured in the same pass, so the frame is only read once.",
+          GST_TYPE_GIMP_COLOR_ENHANCE_STATS_SOURCE,
+          GST_GIMP_COLOR_ENHANCE_STATS_CURRENT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SCENE_CUT_THRESHOLD,
+      g_param_spec_int ("scene-cut-threshold", "Scene cut threshold", "With stats-source set to previous, a frame is enhanced again with its own range if either end of the range moved more than this since the previous frame.",
+          0, 255, 32, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_LOW_PERCENTILE,
+      g_param_spec_double ("low-percentile", "Low percentile", "Percentage of the darkest values ignored when finding the lower end of the value range. Values below the range are clipped.",
+          0.0, 100.0, 0.0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_HIGH_PERCENTILE,
+      g_param_spec_double ("high-percentile", "High percentile", "Percentile of the values used as the upper end of the value range. Values above the range are clipped.",
+          0.0, 100.0, 100.0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads", "Number of threads the frame is split between, in bands of rows. The result does not depend on it.",
+          1, COLOR_ENHANCE_MAX_THREADS, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS_STRIDE,
+      g_param_spec_uint ("stats-stride", "Statistics stride", "Measure the value range on every Nth pixel of every Nth row only. All pixels are still enhanced.",
+          1, 64, 1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_LUT_MODE,
+      g_param_spec_enum ("lut-mode", "LUT mode", "How the transform for a value range is cached. Tetrahedral samples it into a 3D LUT and interpolates, which is approximate, but exact for grays. Exact remembers each computed color. The LUTs of the last 4 ranges are kept.",
+          GST_TYPE_GIMP_COLOR_ENHANCE_LUT_MODE,
+          GST_GIMP_COLOR_ENHANCE_LUT_NONE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS_FILE,
+      g_param_spec_enum ("stats-file", "Statistics file", "Record the value range of each shot to stats-location, or apply the ranges recorded there instead of measuring the frames",
+          GST_TYPE_GIMP_COLOR_ENHANCE_STATS_FILE,
+          GST_GIMP_COLOR_ENHANCE_STATS_FILE_OFF,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS_LOCATION,
+      g_param_spec_string ("stats-location", "Statistics location",
+          "Location of the statistics file", NULL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 /* initialize the new element
@@ -158,6 +336,8 @@ gst_gimp_color_enhance_init (GstGimpColorEnhance * filter,
                                 GST_DEBUG_FUNCPTR(gst_pad_proxy_getcaps));
   gst_pad_set_chain_function (filter->sinkpad,
                               GST_DEBUG_FUNCPTR(gst_gimp_color_enhance_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gimp_color_enhance_sink_event));
 
   filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
   gst_pad_set_getcaps_function (filter->srcpad,
@@ -166,6 +346,44 @@ gst_gimp_color_enhance_init (GstGimpColorEnhance * filter,
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
   filter->silent = FALSE;
+  filter->format = GST_GIMP_COLOR_ENHANCE_FORMAT_RGB;
+  filter->stats_source = GST_GIMP_COLOR_ENHANCE_STATS_CURRENT;
+  filter->scene_cut_threshold = 32;
+  filter->have_prev_range = FALSE;
+  filter->low_percentile = 0.0;
+  filter->high_percentile = 100.0;
+
+  filter->stats_stride = 1;
+  filter->lut_mode = GST_GIMP_COLOR_ENHANCE_LUT_NONE;
+  filter->luts = g_queue_new ();
+  filter->stats_file = GST_GIMP_COLOR_ENHANCE_STATS_FILE_OFF;
+  filter->stats_location = NULL;
+  filter->stats_runs = g_array_new (FALSE, FALSE,
+      sizeof (ColorEnhanceStatsRun));
+  filter->stats_loaded = FALSE;
+  filter->stats_saved = FALSE;
+  filter->threads = 1;
+  filter->pool = NULL;
+  filter->lock = g_mutex_new ();
+  filter->bands_done = g_cond_new ();
+  filter->bands_pending = 0;
+}
+
+static void
+gst_gimp_color_enhance_finalize (GObject * object)
+{
+  GstGimpColorEnhance *filter = GST_GIMPCOLORENHANCE (object);
+
+  if (filter->pool)
+    g_thread_pool_free (filter->pool, FALSE, TRUE);
+  g_queue_foreach (filter->luts, color_enhance_lut_free, NULL);
+  g_queue_free (filter->luts);
+  g_array_free (filter->stats_runs, TRUE);
+  g_free (filter->stats_location);
+  g_cond_free (filter->bands_done);
+  g_mutex_free (filter->lock);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 static void
@@ -178,6 +396,45 @@ gst_gimp_color_enhance_set_property (GObject * object, guint prop_id,
     case PROP_SILENT:
       filter->silent = g_value_get_boolean (value);
       break;
+    case PROP_STATS_SOURCE:
+      filter->stats_source = g_value_get_enum (value);
+      break;
+    case PROP_SCENE_CUT_THRESHOLD:
+      filter->scene_cut_threshold = g_value_get_int (value);
+      break;
+    case PROP_LOW_PERCENTILE:
+      filter->low_percentile = g_value_get_double (value);
+      break;
+    case PROP_HIGH_PERCENTILE:
+      filter->high_percentile = g_value_get_double (value);
+      break;
+    case PROP_STATS_STRIDE:
+      filter->stats_stride = g_value_get_uint (value);
+      break;
+    case PROP_LUT_MODE:
+      /* LUTs of the old mode age out of the cache */
+      filter->lut_mode = g_value_get_enum (value);
+      break;
+    case PROP_STATS_FILE:
+      /* The streaming thread copies these under the lock */
+      GST_OBJECT_LOCK (filter);
+      filter->stats_file = g_value_get_enum (value);
+      filter->stats_loaded = FALSE;
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_STATS_LOCATION:
+      GST_OBJECT_LOCK (filter);
+      g_free (filter->stats_location);
+      filter->stats_location = g_value_dup_string (value);
+      filter->stats_loaded = FALSE;
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_THREADS:
+      filter->threads = g_value_get_uint (value);
+      if (filter->pool)
+        g_thread_pool_set_max_threads (filter->pool,
+            MAX (1, filter->threads - 1), NULL);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -194,6 +451,37 @@ gst_gimp_color_enhance_get_property (GObject * object, guint prop_id,
     case PROP_SILENT:
       g_value_set_boolean (value, filter->silent);
       break;
+    case PROP_STATS_SOURCE:
+      g_value_set_enum (value, filter->stats_source);
+      break;
+    case PROP_SCENE_CUT_THRESHOLD:
+      g_value_set_int (value, filter->scene_cut_threshold);
+      break;
+    case PROP_LOW_PERCENTILE:
+      g_value_set_double (value, filter->low_percentile);
+      break;
+    case PROP_HIGH_PERCENTILE:
+      g_value_set_double (value, filter->high_percentile);
+      break;
+    case PROP_STATS_STRIDE:
+      g_value_set_uint (value, filter->stats_stride);
+      break;
+    case PROP_LUT_MODE:
+      g_value_set_enum (value, filter->lut_mode);
+      break;
+    case PROP_STATS_FILE:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_enum (value, filter->stats_file);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_STATS_LOCATION:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_string (value, filter->stats_location);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint (value, filter->threads);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -202,6 +490,45 @@ gst_gimp_color_enhance_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+static GstStateChangeReturn
+gst_gimp_color_enhance_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstGimpColorEnhance *filter = GST_GIMPCOLORENHANCE (element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      /* A new stream, don't carry the range over */
+      filter->have_prev_range = FALSE;
+      GST_OBJECT_LOCK (filter);
+      if (filter->stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE)
+        g_array_set_size (filter->stats_runs, 0);
+      filter->stats_loaded = FALSE;
+      GST_OBJECT_UNLOCK (filter);
+      filter->stats_saved = FALSE;
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    return ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* The pads are deactivated now, so no more ranges are recorded. This
+       * only writes the file if the stream was stopped before EOS. */
+      gst_gimp_color_enhance_finish_stats (filter);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
 /* this function handles the link with other elements */
 static gboolean
 gst_gimp_color_enhance_set_caps (GstPad * pad, GstCaps * caps)
@@ -210,16 +537,30 @@ gst_gimp_color_enhance_set_caps (GstPad * pad, GstCaps * caps)
   GstPad *otherpad;
   GstStructure *capstruct = gst_caps_get_structure (caps, 0);
   const gchar *mimetype;  
+  GstGimpColorEnhanceFormat format;
+  guint32 fourcc;
 
   mimetype = gst_structure_get_name (capstruct);
-  if(strcmp(mimetype, "video/x-raw-rgb") != 0) {
-    g_print ("No gimpcolorenhance support for %s, only for video/x-raw-rgb.\n",
-             mimetype);
+  if(strcmp(mimetype, "video/x-raw-rgb") == 0) {
+    format = GST_GIMP_COLOR_ENHANCE_FORMAT_RGB;
+  } else if(strcmp(mimetype, "video/x-raw-yuv") == 0 &&
+      gst_structure_get_fourcc (capstruct, "format", &fourcc) &&
+      fourcc == GST_MAKE_FOURCC ('I', '4', '2', '0')) {
+    format = GST_GIMP_COLOR_ENHANCE_FORMAT_I420;
+  } else if(strcmp(mimetype, "video/x-raw-yuv") == 0 &&
+      gst_structure_get_fourcc (capstruct, "format", &fourcc) &&
+      fourcc == GST_MAKE_FOURCC ('A', 'Y', 'U', 'V')) {
+    format = GST_GIMP_COLOR_ENHANCE_FORMAT_AYUV;
+  } else {
+    g_print ("No gimpcolorenhance support for %s, only for video/x-raw-rgb, "
+             "I420 and AYUV.\n", mimetype);
     return FALSE;
   }
 
   filter = GST_GIMPCOLORENHANCE (gst_pad_get_parent (pad));
 
+  filter->format = format;
+
   gst_structure_get_int (capstruct, "width", &filter->width);
   gst_structure_get_int (capstruct, "height", &filter->height);
 
@@ -233,6 +574,35 @@ gst_gimp_color_enhance_set_caps (GstPad * pad, GstCaps * caps)
 
 #define ROUND(x) ((int) ((x) + 0.5))
 
+/* Reciprocals for division by a variable 8-bit divisor: for 0 <= n <= 65535
+ * and 1 <= d <= 255, n / d == (n * reciprocal[d]) >> 32, because the rounding
+ * error of the reciprocal times n stays below 2^32 / d. Divisions by
+ * constants are left to the compiler, which already emits multiply-shift
+ * sequences for them.
+ */
+
+static guint64 reciprocal[256];
+
+static void
+init_reciprocals (void)
+{
+  gint d;
+
+  reciprocal[0] = 0;
+  for (d = 1; d < 256; d++)
+    reciprocal[d] = (G_GUINT64_CONSTANT (1) << 32) / d + 1;
+}
+
+/* n / d with C truncation, for |n| <= 65535 */
+static inline gint
+reciprocal_div (gint n, guint8 d)
+{
+  if (n < 0)
+    return -(gint) (((guint64) -n * reciprocal[d]) >> 32);
+
+  return (gint) (((guint64) n * reciprocal[d]) >> 32);
+}
+
 /* GIMP color space conversion functions, converted to integer only for
  * speed. */
 
@@ -267,7 +637,7 @@ gimp_rgb_to_hsv4 (const guint8 *rgb,
   v = max;
 
   if (max != 0)
-    s = (max - min) * 255 / max;
+    s = reciprocal_div ((max - min) * 255, max);
   else
     s = 0;
 
@@ -281,11 +651,11 @@ gimp_rgb_to_hsv4 (const guint8 *rgb,
         delta = 255;
 
       if (red == max)
-        h = (green - blue) * 255 / delta;
+        h = reciprocal_div ((green - blue) * 255, delta);
       else if (green == max)
-        h = 510 + (blue - red) * 255 / delta;
+        h = 510 + reciprocal_div ((blue - red) * 255, delta);
       else if (blue == max)
-        h = 1020 + (red - green) * 255 / delta;
+        h = 1020 + reciprocal_div ((red - green) * 255, delta);
 
       h *= 60;
       h /= 255;
@@ -389,20 +759,71 @@ typedef struct
   guint8  vlo;
 } ColorEnhanceParam_t;
 
+/* Find vhi and vlo in a V histogram, skipping the given fraction of pixels at
+ * both ends. With no pixels skipped, this is the minimum and maximum of V, as
+ * in The GIMP.
+ */
 static void
-find_vhi_vlo (const guint8 *src,
-              gpointer      data)
+find_vhi_vlo (const guint32 *hist,
+              gdouble        low,
+              gdouble        high,
+              gpointer       data)
 {
   ColorEnhanceParam_t *param = (ColorEnhanceParam_t*) data;
+  guint64 total = 0, skip, count;
+  gint v;
 
-  guint8 v = src[2];
+  for (v = 0; v < 256; v++)
+    total += hist[v];
 
-  if (v > param->vhi) param->vhi = v;
-  if (v < param->vlo) param->vlo = v;
+  param->vlo = param->vhi = 0;
+  if (total == 0)
+    return;
+
+  skip = (guint64) (low * total);
+  for (v = 0, count = 0; v < 255; v++)
+    {
+      count += hist[v];
+      if (count > skip)
+        break;
+    }
+  param->vlo = v;
+
+  skip = (guint64) ((1.0 - high) * total);
+  for (v = 255, count = 0; v > 0; v--)
+    {
+      count += hist[v];
+      if (count > skip)
+        break;
+    }
+  param->vhi = MAX (v, param->vlo);
+}
+
+/* The V that colorspace_prepare computes for an RGB pixel, without the
+ * conversion. The CMY map has K subtracted, so its maximum is the difference
+ * of the largest and smallest RGB components.
+ */
+static inline guint8
+colorspace_get_v (const guint8 *src)
+{
+  guint8 max, min;
+
+  if (src[0] > src[1])
+    {
+      max = MAX (src[0], src[2]);
+      min = MIN (src[1], src[2]);
+    }
+  else
+    {
+      max = MAX (src[1], src[2]);
+      min = MIN (src[0], src[2]);
+    }
+
+  return max - min;
 }
 
 static void
-colorspace_prepare (guint8 *src, guint8 *dest)
+colorspace_prepare (const guint8 *src, guint8 *dest)
 {
   guint8  h, z, v;
   gint    c, m, y;
@@ -456,20 +877,977 @@ colorspace_prepare_reverse (guint8 *src, guint8 *dest)
   dest[2] = 255 - y;
 }
 
+/* The stretch only depends on V, so it is tabulated once per frame */
 static void
-enhance_it (const guint8 *src, guint8 *dest, guint8 vlo, guint8 vhi)
+enhance_prepare (guint8 *lut, guint8 vlo, guint8 vhi)
 {
-  guint8 v;
+  gint v;
 
-  v = src[2];
+  for (v = 0; v < 256; v++)
+    {
+      if (vhi != vlo)
+        lut[v] = (MIN (MAX (v, vlo), vhi) - vlo) * 255 / (vhi - vlo);
+      else
+        lut[v] = v;
+    }
+}
 
-  if (vhi != vlo)
-    v = (v - vlo) * 255 / (vhi - vlo);
+static void
+enhance_it (const guint8 *src, guint8 *dest, const guint8 *lut)
+{
+  dest[2] = lut[src[2]];
+}
 
-  dest[2] = v;
+
+
+/* Add the V values of the pixels to hist. Only V is needed for this, so
+ * nothing is converted. Consecutive pixels are counted in separate
+ * histograms, so their increments don't wait for each other when they fall
+ * into the same bin.
+ */
+static void
+color_enhance_measure (const guint8 *src,
+                       gint          n_pixels,
+                       guint32      *hist)
+{
+  guint32 lanes[COLOR_ENHANCE_HIST_LANES][256];
+  gint i, l, v;
+
+  memset (lanes, 0, sizeof (lanes));
+
+  for (i = 0; i + COLOR_ENHANCE_HIST_LANES <= n_pixels;
+      i += COLOR_ENHANCE_HIST_LANES) {
+    for (l = 0; l < COLOR_ENHANCE_HIST_LANES; l++)
+      lanes[l][colorspace_get_v (src + (i + l)*3)]++;
+  }
+  for (; i < n_pixels; i++)
+    lanes[0][colorspace_get_v (src + i*3)]++;
+
+  for (v = 0; v < 256; v++)
+    for (l = 0; l < COLOR_ENHANCE_HIST_LANES; l++)
+      hist[v] += lanes[l][v];
+}
+
+/* Like color_enhance_measure, but only for the pixels of a band of rows that
+ * lie on a grid of the given stride. first_row is the index of the band's
+ * first row in the frame, so bands share the grid.
+ */
+static void
+color_enhance_measure_sparse (const guint8 *src,
+                              gint          width,
+                              gint          first_row,
+                              gint          rows,
+                              gint          stride,
+                              guint32      *hist)
+{
+  gint x, y;
+
+  for (y = (stride - first_row % stride) % stride; y < rows; y += stride) {
+    const guint8 *row = src + y * width * 3;
+
+    for (x = 0; x < width; x += stride)
+      hist[colorspace_get_v (row + x*3)]++;
+  }
+}
+
+/* Cached transforms for one value range. In tetrahedral mode, the transform
+ * is sampled on a grid of COLOR_ENHANCE_LUT_NODES^3 colors, 8 apart, with the
+ * last node at 255, and interpolated in between. In exact mode, results are
+ * stored in a hash table as they are computed, so colors seen before only
+ * cost a lookup.
+ */
+typedef struct
+{
+  GstGimpColorEnhanceLutMode mode;
+  guint8   vlo, vhi;
+  guint8  *grid;   /* RGB triplets, red varying slowest */
+  guint64 *slots;  /* Valid bit, 24-bit key and 24-bit value in each word */
+} ColorEnhanceLut;
+
+#define LUT_SLOT_VALID (G_GUINT64_CONSTANT (1) << 63)
+#define LUT_SLOTS (1 << COLOR_ENHANCE_LUT_EXACT_BITS)
+
+/* Bands fill the exact cache concurrently. A slot is always written as one
+ * word, so readers see either the old or the new entry.
+ */
+#ifdef __ATOMIC_RELAXED
+#define LUT_SLOT_GET(slot) __atomic_load_n (slot, __ATOMIC_RELAXED)
+#define LUT_SLOT_SET(slot, v) __atomic_store_n (slot, v, __ATOMIC_RELAXED)
+#else
+#define LUT_SLOT_GET(slot) (*(volatile guint64 *) (slot))
+#define LUT_SLOT_SET(slot, v) (*(volatile guint64 *) (slot) = (v))
+#endif
+
+static inline void
+color_enhance_direct (guint8 *rgb, const guint8 *lut)
+{
+  guint8 hsvk[4];
+
+  colorspace_prepare (rgb, hsvk);
+  enhance_it (hsvk, hsvk, lut);
+  colorspace_prepare_reverse (hsvk, rgb);
+}
+
+static ColorEnhanceLut *
+color_enhance_lut_new (GstGimpColorEnhanceLutMode mode,
+                       guint8                     vlo,
+                       guint8                     vhi)
+{
+  ColorEnhanceLut *lut3d = g_new0 (ColorEnhanceLut, 1);
+  guint8 lut[256];
+  gint r, g, b;
+
+  lut3d->mode = mode;
+  lut3d->vlo = vlo;
+  lut3d->vhi = vhi;
+
+  if (mode == GST_GIMP_COLOR_ENHANCE_LUT_EXACT) {
+    /* Zero is an empty slot */
+    lut3d->slots = g_new0 (guint64, LUT_SLOTS);
+    return lut3d;
+  }
+
+  enhance_prepare (lut, vlo, vhi);
+  lut3d->grid = g_new (guint8, COLOR_ENHANCE_LUT_NODES *
+      COLOR_ENHANCE_LUT_NODES * COLOR_ENHANCE_LUT_NODES * 3);
+
+  for (r = 0; r < COLOR_ENHANCE_LUT_NODES; r++)
+    for (g = 0; g < COLOR_ENHANCE_LUT_NODES; g++)
+      for (b = 0; b < COLOR_ENHANCE_LUT_NODES; b++) {
+        guint8 *node = lut3d->grid + ((r * COLOR_ENHANCE_LUT_NODES + g) *
+            COLOR_ENHANCE_LUT_NODES + b) * 3;
+
+        node[0] = MIN (r * 8, 255);
+        node[1] = MIN (g * 8, 255);
+        node[2] = MIN (b * 8, 255);
+        color_enhance_direct (node, lut);
+      }
+
+  return lut3d;
+}
+
+static void
+color_enhance_lut_free (gpointer data, gpointer user_data)
+{
+  ColorEnhanceLut *lut3d = (ColorEnhanceLut *) data;
+
+  g_free (lut3d->grid);
+  g_free (lut3d->slots);
+  g_free (lut3d);
+}
+
+/* Grid cell of one channel value, and the weight of the upper node in 64ths.
+ * The nodes are 8 apart, except for the last two, 248 and 255.
+ */
+static inline gint
+color_enhance_lut_axis (guint8 v, gint *weight)
+{
+  gint i = MIN (v >> 3, COLOR_ENHANCE_LUT_NODES - 2);
+  gint width = (i == COLOR_ENHANCE_LUT_NODES - 2) ? 255 - i * 8 : 8;
+
+  *weight = ((v - i * 8) * 64 + width / 2) / width;
+  return i;
+}
+
+/* Each grid cell is split into six tetrahedra along its diagonal from the
+ * darkest to the brightest corner, and the color is interpolated between the
+ * four corners of the one it falls in. Unlike trilinear interpolation, this
+ * keeps grays on the gray nodes only.
+ */
+static inline void
+color_enhance_lut_tetrahedral (const ColorEnhanceLut *lut3d, guint8 *rgb)
+{
+  const gint n = COLOR_ENHANCE_LUT_NODES;
+  gint fr, fg, fb;
+  gint ir = color_enhance_lut_axis (rgb[0], &fr);
+  gint ig = color_enhance_lut_axis (rgb[1], &fg);
+  gint ib = color_enhance_lut_axis (rgb[2], &fb);
+  const guint8 *p = lut3d->grid + ((ir * n + ig) * n + ib) * 3;
+  gint dr = n * n * 3, dg = n * 3, db = 3;
+  gint d1, d2, w0, w1, w2, w3;
+  gint c;
+
+  /* d1 and d2 are the corners between the darkest and the brightest one,
+   * stepping along the axes in order of decreasing weight */
+  if (fr >= fg && fg >= fb) {
+    d1 = dr; d2 = dr + dg; w0 = 64 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+  } else if (fr >= fb && fb >= fg) {
+    d1 = dr; d2 = dr + db; w0 = 64 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+  } else if (fb >= fr && fr >= fg) {
+    d1 = db; d2 = dr + db; w0 = 64 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+  } else if (fg >= fr && fr >= fb) {
+    d1 = dg; d2 = dr + dg; w0 = 64 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+  } else if (fg >= fb && fb >= fr) {
+    d1 = dg; d2 = dg + db; w0 = 64 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+  } else {
+    d1 = db; d2 = dg + db; w0 = 64 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+  }
+
+  for (c = 0; c < 3; c++)
+    rgb[c] = (p[c] * w0 + p[d1 + c] * w1 + p[d2 + c] * w2 +
+        p[dr + dg + db + c] * w3 + 32) >> 6;
+}
+
+#ifndef GST_DISABLE_GST_DEBUG
+/* Compare the interpolated LUT with the direct transform, on the gray axis,
+ * where it should match, and on a coarse grid of colors */
+static void
+color_enhance_lut_check (GstGimpColorEnhance *filter,
+                         const ColorEnhanceLut *lut3d)
+{
+  guint8 lut[256];
+  gint gray_error = 0, color_error = 0;
+  gint r, g, b, c;
+
+  enhance_prepare (lut, lut3d->vlo, lut3d->vhi);
+
+  for (r = 0; r < 256; r++)
+    for (g = (r & 15) ? r : 0; g < 256; g += (r & 15) ? 256 : 17)
+      for (b = (r & 15) ? r : 0; b < 256; b += (r & 15) ? 256 : 17) {
+        guint8 direct[3] = { r, g, b };
+        guint8 interpolated[3] = { r, g, b };
+
+        color_enhance_direct (direct, lut);
+        color_enhance_lut_tetrahedral (lut3d, interpolated);
+
+        for (c = 0; c < 3; c++) {
+          gint error = ABS (direct[c] - interpolated[c]);
+
+          if (r == g && g == b)
+            gray_error = MAX (gray_error, error);
+          else
+            color_error = MAX (color_error, error);
+        }
+      }
+
+  GST_DEBUG_OBJECT (filter, "LUT for range %d-%d: max error %d on grays, "
+      "%d on other colors", lut3d->vlo, lut3d->vhi, gray_error, color_error);
+
+  if (gray_error > 1)
+    GST_WARNING_OBJECT (filter, "LUT for range %d-%d is off by %d on grays",
+        lut3d->vlo, lut3d->vhi, gray_error);
+}
+#endif
+
+static inline void
+color_enhance_lut_exact (const ColorEnhanceLut *lut3d, guint8 *rgb,
+    const guint8 *lut)
+{
+  guint32 key = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+  guint64 *slot = lut3d->slots + ((key * 2654435761u) >>
+      (32 - COLOR_ENHANCE_LUT_EXACT_BITS));
+  guint64 entry = LUT_SLOT_GET (slot);
+
+  if (entry & LUT_SLOT_VALID && (guint32) ((entry >> 24) & 0xffffff) == key) {
+    rgb[0] = entry >> 16;
+    rgb[1] = entry >> 8;
+    rgb[2] = entry;
+    return;
+  }
+
+  color_enhance_direct (rgb, lut);
+  LUT_SLOT_SET (slot, LUT_SLOT_VALID | ((guint64) key << 24) |
+      (rgb[0] << 16) | (rgb[1] << 8) | rgb[2]);
+}
+
+/* Everything needed to enhance a pixel with one value range */
+typedef struct
+{
+  guint8                 lut[256];
+  const ColorEnhanceLut *lut3d;    /* NULL to compute every pixel */
+} ColorEnhanceTransform;
+
+static inline void
+color_enhance_pixel (guint8 *rgb, const ColorEnhanceTransform *transform)
+{
+  if (transform->lut3d == NULL)
+    color_enhance_direct (rgb, transform->lut);
+  else if (transform->lut3d->mode == GST_GIMP_COLOR_ENHANCE_LUT_EXACT)
+    color_enhance_lut_exact (transform->lut3d, rgb, transform->lut);
+  else
+    color_enhance_lut_tetrahedral (transform->lut3d, rgb);
+}
+
+/* Find the cached transform for the range, building it if needed. Recently
+ * used ones are kept at the head of the queue.
+ */
+static const ColorEnhanceLut *
+gst_gimp_color_enhance_get_lut (GstGimpColorEnhance *filter,
+                                guint8               vlo,
+                                guint8               vhi)
+{
+  ColorEnhanceLut *lut3d;
+  GList *l;
+
+  if (filter->lut_mode == GST_GIMP_COLOR_ENHANCE_LUT_NONE)
+    return NULL;
+
+  for (l = filter->luts->head; l; l = l->next) {
+    lut3d = (ColorEnhanceLut *) l->data;
+
+    if (lut3d->mode == filter->lut_mode && lut3d->vlo == vlo &&
+        lut3d->vhi == vhi) {
+      g_queue_unlink (filter->luts, l);
+      g_queue_push_head_link (filter->luts, l);
+      return lut3d;
+    }
+  }
+
+  GST_DEBUG_OBJECT (filter, "building LUT for range %d-%d", vlo, vhi);
+
+  lut3d = color_enhance_lut_new (filter->lut_mode, vlo, vhi);
+  g_queue_push_head (filter->luts, lut3d);
+
+#ifndef GST_DISABLE_GST_DEBUG
+  if (lut3d->mode == GST_GIMP_COLOR_ENHANCE_LUT_TETRAHEDRAL &&
+      gst_debug_category_get_threshold (GST_CAT_DEFAULT) >= GST_LEVEL_DEBUG)
+    color_enhance_lut_check (filter, lut3d);
+#endif
+
+  while (g_queue_get_length (filter->luts) > COLOR_ENHANCE_LUT_CACHE)
+    color_enhance_lut_free (g_queue_pop_tail (filter->luts), NULL);
+
+  return lut3d;
+}
+
+/* Convert, enhance and convert back one pixel at a time, so the HSVK values
+ * never leave the stack. The vectorized kernel does the same for blocks of
+ * pixels, leaving the tail to the scalar loop. src and dest may be the same.
+ */
+static void
+color_enhance_apply (const guint8          *src,
+                     guint8                *dest,
+                     gint                   n_pixels,
+                     guint8                 vlo,
+                     guint8                 vhi,
+                     const ColorEnhanceLut *lut3d)
+{
+  guint8 hsvk[4];
+  guint8 lut[256];
+  gint i = 0;
+
+  enhance_prepare (lut, vlo, vhi);
+
+  if (lut3d) {
+    ColorEnhanceTransform transform;
+
+    memcpy (transform.lut, lut, sizeof (lut));
+    transform.lut3d = lut3d;
+
+    for(; i < n_pixels; i++) {
+      dest[i*3]   = src[i*3];
+      dest[i*3+1] = src[i*3+1];
+      dest[i*3+2] = src[i*3+2];
+      color_enhance_pixel (dest + i*3, &transform);
+    }
+    return;
+  }
+
+  if (color_enhance_simd)
+    i = color_enhance_simd (src, dest, n_pixels, vlo, vhi);
+
+  for(; i < n_pixels; i++) {
+    colorspace_prepare (src + i*3, hsvk);
+    enhance_it (hsvk, hsvk, lut);
+    colorspace_prepare_reverse (hsvk, dest + i*3);
+  }
+}
+
+/* YUV support. Pixels are converted to RGB with BT.601 fixed-point math, one
+ * at a time, enhanced in RGB and converted back, so no converter elements are
+ * needed around the filter.
+ */
+
+static inline guint8
+clamp_byte (gint v)
+{
+  return (guint8) CLAMP (v, 0, 255);
+}
+
+static inline void
+yuv_to_rgb (gint y, gint u, gint v, guint8 *rgb)
+{
+  gint c = 298 * (y - 16);
+  gint d = u - 128;
+  gint e = v - 128;
+
+  rgb[0] = clamp_byte ((c + 409 * e + 128) >> 8);
+  rgb[1] = clamp_byte ((c - 100 * d - 208 * e + 128) >> 8);
+  rgb[2] = clamp_byte ((c + 516 * d + 128) >> 8);
+}
+
+static inline guint8
+rgb_to_y (const guint8 *rgb)
+{
+  return ((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8) + 16;
+}
+
+static inline gint
+rgb_to_u (const guint8 *rgb)
+{
+  return ((-38 * rgb[0] - 74 * rgb[1] + 112 * rgb[2] + 128) >> 8) + 128;
+}
+
+static inline gint
+rgb_to_v (const guint8 *rgb)
+{
+  return ((112 * rgb[0] - 94 * rgb[1] - 18 * rgb[2] + 128) >> 8) + 128;
+}
+
+/* Plane layout of I420 frames in GStreamer 0.10 */
+static void
+i420_planes (const guint8  *frame,
+             gint           width,
+             gint           height,
+             const guint8 **y,
+             const guint8 **u,
+             const guint8 **v,
+             gint          *y_stride,
+             gint          *c_stride)
+{
+  *y_stride = GST_ROUND_UP_4 (width);
+  *c_stride = GST_ROUND_UP_8 (width) / 2;
+  *y = frame;
+  *u = *y + *y_stride * GST_ROUND_UP_2 (height);
+  *v = *u + *c_stride * (GST_ROUND_UP_2 (height) / 2);
+}
+
+/* Measure and/or enhance one row of an AYUV frame */
+static void
+color_enhance_ayuv_row (const guint8 *src,
+                        guint8       *dest,
+                        gint          width,
+                        gint          stride,
+                        guint32      *hist,
+                        const ColorEnhanceTransform *transform)
+{
+  guint8 rgb[3];
+  gint x;
+
+  if (hist) {
+    for (x = 0; x < width; x += stride) {
+      const guint8 *p = src + x * 4;
+
+      yuv_to_rgb (p[1], p[2], p[3], rgb);
+      hist[colorspace_get_v (rgb)]++;
+    }
+  }
+
+  if (transform) {
+    for (x = 0; x < width; x++) {
+      const guint8 *p = src + x * 4;
+      guint8 *q = dest + x * 4;
+
+      yuv_to_rgb (p[1], p[2], p[3], rgb);
+      color_enhance_pixel (rgb, transform);
+      q[0] = p[0];
+      q[1] = rgb_to_y (rgb);
+      q[2] = clamp_byte (rgb_to_u (rgb));
+      q[3] = clamp_byte (rgb_to_v (rgb));
+    }
+  }
+}
+
+/* Measure one luma row of an I420 frame, chroma_row being the matching row
+ * of the U and V planes
+ */
+static void
+color_enhance_i420_measure_row (const guint8 *y_row,
+                                const guint8 *u_row,
+                                const guint8 *v_row,
+                                gint          width,
+                                gint          stride,
+                                guint32      *hist)
+{
+  guint8 rgb[3];
+  gint x;
+
+  for (x = 0; x < width; x += stride) {
+    yuv_to_rgb (y_row[x], u_row[x / 2], v_row[x / 2], rgb);
+    hist[colorspace_get_v (rgb)]++;
+  }
+}
+
+/* Enhance a pair of I420 luma rows (or a single last row) and the chroma
+ * row they share. Each pixel is enhanced with the chroma of its block, and
+ * the new chroma is the average of the block's results.
+ */
+static void
+color_enhance_i420_apply_rows (const guint8 *y_src,
+                               const guint8 *u_src,
+                               const guint8 *v_src,
+                               guint8       *y_dest,
+                               guint8       *u_dest,
+                               guint8       *v_dest,
+                               gint          y_stride,
+                               gint          width,
+                               gint          rows,
+                               const ColorEnhanceTransform *transform)
+{
+  guint8 rgb[3];
+  gint bx, dx, dy;
+
+  for (bx = 0; bx < (width + 1) / 2; bx++) {
+    gint u = u_src[bx], v = v_src[bx];
+    gint u_sum = 0, v_sum = 0, count = 0;
+
+    for (dy = 0; dy < rows; dy++) {
+      for (dx = 0; dx < 2 && bx * 2 + dx < width; dx++) {
+        gint offset = dy * y_stride + bx * 2 + dx;
+
+        yuv_to_rgb (y_src[offset], u, v, rgb);
+        color_enhance_pixel (rgb, transform);
+        y_dest[offset] = rgb_to_y (rgb);
+        u_sum += rgb_to_u (rgb);
+        v_sum += rgb_to_v (rgb);
+        count++;
+      }
+    }
+
+    u_dest[bx] = clamp_byte ((u_sum + count / 2) / count);
+    v_dest[bx] = clamp_byte ((v_sum + count / 2) / count);
+  }
+}
+
+/* Process the rows of a band of a YUV frame. Statistics are measured on a row
+ * just before it is enhanced, so the frame is read once.
+ */
+static void
+color_enhance_yuv_band (GstGimpColorEnhanceFormat  format,
+                        const guint8              *src,
+                        guint8                    *dest,
+                        gint                       width,
+                        gint                       height,
+                        gint                       first_row,
+                        gint                       rows,
+                        gint                       stride,
+                        guint32                   *hist,
+                        const ColorEnhanceTransform *transform)
+{
+  gint y;
+
+  if (format == GST_GIMP_COLOR_ENHANCE_FORMAT_AYUV) {
+    for (y = first_row; y < first_row + rows; y++) {
+      gint offset = y * width * 4;
+
+      color_enhance_ayuv_row (src + offset, dest + offset, width, stride,
+          (hist && y % stride == 0) ? hist : NULL, transform);
+    }
+  } else {
+    const guint8 *ys, *us, *vs, *yd, *ud, *vd;
+    gint y_stride, c_stride;
+
+    i420_planes (src, width, height, &ys, &us, &vs, &y_stride, &c_stride);
+    i420_planes (dest, width, height, &yd, &ud, &vd, &y_stride, &c_stride);
+
+    /* Bands of I420 frames start on even rows */
+    for (y = first_row; y < first_row + rows; y += 2) {
+      gint pair = MIN (2, height - y);
+      gint c = (y / 2) * c_stride;
+      gint r;
+
+      for (r = 0; hist && r < pair; r++) {
+        if ((y + r) % stride == 0)
+          color_enhance_i420_measure_row (ys + (y + r) * y_stride, us + c,
+              vs + c, width, stride, hist);
+      }
+
+      if (transform)
+        color_enhance_i420_apply_rows (ys + y * y_stride, us + c, vs + c,
+            (guint8 *) yd + y * y_stride, (guint8 *) ud + c,
+            (guint8 *) vd + c, y_stride, width, pair, transform);
+    }
+  }
 }
 
+/* A band of rows, measured and/or enhanced by one thread */
+typedef struct
+{
+  GstGimpColorEnhanceFormat format;
+  const guint8 *src;         /* Start of the band, or of the frame in YUV */
+  guint8       *dest;
+  gint          n_pixels;
+  gint          width, height, first_row, rows;
+  gint          stride;      /* Statistics stride */
+  gboolean      measure, apply;
+  guint8        vlo, vhi;    /* Range to apply */
+  const ColorEnhanceLut *lut3d;
+  guint32       hist[256];   /* V histogram of the band, when measuring */
+} ColorEnhanceBand;
 
+static void
+color_enhance_band (ColorEnhanceBand *band)
+{
+  gint i;
+
+  if (band->format != GST_GIMP_COLOR_ENHANCE_FORMAT_RGB) {
+    ColorEnhanceTransform transform;
+
+    if (band->apply) {
+      enhance_prepare (transform.lut, band->vlo, band->vhi);
+      transform.lut3d = band->lut3d;
+    }
+    color_enhance_yuv_band (band->format, band->src, band->dest, band->width,
+        band->height, band->first_row, band->rows, band->stride,
+        band->measure ? band->hist : NULL, band->apply ? &transform : NULL);
+  } else if (band->stride > 1) {
+    /* The sparse reads don't cost much, so there is no point in
+     * interleaving them with the enhancement */
+    if (band->measure)
+      color_enhance_measure_sparse (band->src, band->width, band->first_row,
+          band->rows, band->stride, band->hist);
+    if (band->apply)
+      color_enhance_apply (band->src, band->dest, band->n_pixels, band->vlo,
+          band->vhi, band->lut3d);
+  } else if (band->measure && band->apply) {
+    /* Measure each chunk just before enhancing it, while it is in the
+     * cache */
+    for (i = 0; i < band->n_pixels; i += COLOR_ENHANCE_CHUNK) {
+      gint chunk = MIN (COLOR_ENHANCE_CHUNK, band->n_pixels - i);
+
+      color_enhance_measure (band->src + i*3, chunk, band->hist);
+      color_enhance_apply (band->src + i*3, band->dest + i*3, chunk,
+          band->vlo, band->vhi, band->lut3d);
+    }
+  } else if (band->measure) {
+    color_enhance_measure (band->src, band->n_pixels, band->hist);
+  } else if (band->apply) {
+    color_enhance_apply (band->src, band->dest, band->n_pixels, band->vlo,
+        band->vhi, band->lut3d);
+  }
+}
+
+static void
+color_enhance_band_thread (gpointer data, gpointer user_data)
+{
+  GstGimpColorEnhance *filter = GST_GIMPCOLORENHANCE (user_data);
+
+  color_enhance_band ((ColorEnhanceBand *) data);
+
+  g_mutex_lock (filter->lock);
+  if (--filter->bands_pending == 0)
+    g_cond_signal (filter->bands_done);
+  g_mutex_unlock (filter->lock);
+}
+
+/* Process all bands, the first one in the calling thread, and return when
+ * they are done.
+ */
+static void
+color_enhance_run_bands (GstGimpColorEnhance *filter,
+                         ColorEnhanceBand    *bands,
+                         gint                 n_bands)
+{
+  gint b;
+
+  if (n_bands > 1 && filter->pool == NULL) {
+    filter->pool = g_thread_pool_new (color_enhance_band_thread, filter,
+        MAX (1, filter->threads - 1), FALSE, NULL);
+  }
+
+  if (n_bands == 1 || filter->pool == NULL) {
+    for (b = 0; b < n_bands; b++)
+      color_enhance_band (&bands[b]);
+    return;
+  }
+
+  filter->bands_pending = n_bands - 1;
+  for (b = 1; b < n_bands; b++)
+    g_thread_pool_push (filter->pool, &bands[b], NULL);
+
+  color_enhance_band (&bands[0]);
+
+  g_mutex_lock (filter->lock);
+  while (filter->bands_pending > 0)
+    g_cond_wait (filter->bands_done, filter->lock);
+  g_mutex_unlock (filter->lock);
+}
+
+/* Split the frame into at most max_bands bands of whole rows */
+static gint
+color_enhance_split (GstGimpColorEnhance *filter,
+                     ColorEnhanceBand    *bands,
+                     gint                 max_bands,
+                     const guint8        *src,
+                     guint8              *dest)
+{
+  gint n_bands = MAX (1, MIN (max_bands, filter->height));
+  gint b;
+
+  for (b = 0; b < n_bands; b++) {
+    gint first = filter->height * b / n_bands;
+    gint last = filter->height * (b + 1) / n_bands;
+
+    bands[b].format = filter->format;
+    if (filter->format == GST_GIMP_COLOR_ENHANCE_FORMAT_RGB) {
+      bands[b].src = src + first * filter->width * 3;
+      bands[b].dest = dest + first * filter->width * 3;
+    } else {
+      bands[b].src = src;
+      bands[b].dest = dest;
+    }
+    if (filter->format == GST_GIMP_COLOR_ENHANCE_FORMAT_I420) {
+      /* Rows sharing chroma stay in the same band */
+      first = GST_ROUND_UP_2 (first);
+      last = (b == n_bands - 1) ? filter->height : GST_ROUND_UP_2 (last);
+    }
+    bands[b].n_pixels = (last - first) * filter->width;
+    bands[b].width = filter->width;
+    bands[b].height = filter->height;
+    bands[b].first_row = first;
+    bands[b].rows = last - first;
+    bands[b].stride = filter->stats_stride;
+    memset (bands[b].hist, 0, sizeof (bands[b].hist));
+  }
+
+  return n_bands;
+}
+
+/* Merge the band histograms and find the range in the sum */
+static void
+color_enhance_reduce (GstGimpColorEnhance *filter,
+                      ColorEnhanceBand    *bands,
+                      gint                 n_bands,
+                      ColorEnhanceParam_t *param)
+{
+  guint32 hist[256];
+  gint b, v;
+
+  memcpy (hist, bands[0].hist, sizeof (hist));
+  for (b = 1; b < n_bands; b++)
+    for (v = 0; v < 256; v++)
+      hist[v] += bands[b].hist[v];
+
+  find_vhi_vlo (hist, filter->low_percentile / 100.0,
+      filter->high_percentile / 100.0, (gpointer) param);
+}
+
+static void
+color_enhance_set_pass (GstGimpColorEnhance *filter,
+                        ColorEnhanceBand    *bands,
+                        gint                 n_bands,
+                        gboolean             measure,
+                        gboolean             apply,
+                        guint8               vlo,
+                        guint8               vhi)
+{
+  const ColorEnhanceLut *lut3d = NULL;
+  gint b;
+
+  if (apply)
+    lut3d = gst_gimp_color_enhance_get_lut (filter, vlo, vhi);
+
+  for (b = 0; b < n_bands; b++) {
+    bands[b].lut3d = lut3d;
+    bands[b].measure = measure;
+    bands[b].apply = apply;
+    bands[b].vlo = vlo;
+    bands[b].vhi = vhi;
+  }
+}
+
+/* Statistics file
+ *
+ * The file lists the frames at which the value range changes, one run per
+ * line, with the timestamp of its first frame in nanoseconds:
+ *
+ *   # gimpcolorenhance stats
+ *   <count>
+ *   <start> <vlo> <vhi>
+ *   ...
+ */
+
+/* Add the range of a frame, starting a new run if it differs from the last */
+static void
+gst_gimp_color_enhance_record_range (GstGimpColorEnhance * filter,
+    GstClockTime timestamp, const ColorEnhanceParam_t * param)
+{
+  ColorEnhanceStatsRun run;
+
+  if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+    return;
+
+  if (filter->stats_runs->len > 0) {
+    const ColorEnhanceStatsRun *last = &g_array_index (filter->stats_runs,
+        ColorEnhanceStatsRun, filter->stats_runs->len - 1);
+
+    if (last->vlo == param->vlo && last->vhi == param->vhi)
+      return;
+  }
+
+  run.start = timestamp;
+  run.vlo = param->vlo;
+  run.vhi = param->vhi;
+  g_array_append_val (filter->stats_runs, run);
+  filter->stats_saved = FALSE;
+}
+
+static void
+gst_gimp_color_enhance_save_stats (GstGimpColorEnhance * filter,
+    const gchar * location)
+{
+  GString *contents;
+  GError *error = NULL;
+  guint i;
+
+  contents = g_string_new ("# gimpcolorenhance stats\n");
+  g_string_append_printf (contents, "%u\n", filter->stats_runs->len);
+
+  for (i = 0; i < filter->stats_runs->len; i++) {
+    const ColorEnhanceStatsRun *run =
+        &g_array_index (filter->stats_runs, ColorEnhanceStatsRun, i);
+
+    g_string_append_printf (contents, "%" G_GUINT64_FORMAT " %u %u\n",
+        (guint64) run->start, run->vlo, run->vhi);
+  }
+
+  if (!g_file_set_contents (location, contents->str, contents->len, &error)) {
+    GST_ELEMENT_WARNING (filter, RESOURCE, WRITE,
+        ("Could not save statistics to %s", location),
+        ("%s", error->message));
+    g_error_free (error);
+  }
+
+  g_string_free (contents, TRUE);
+}
+
+/* Write the runs recorded in analyze mode, unless they already were */
+static void
+gst_gimp_color_enhance_finish_stats (GstGimpColorEnhance * filter)
+{
+  GstGimpColorEnhanceStatsFile stats_file;
+  gchar *location;
+
+  GST_OBJECT_LOCK (filter);
+  stats_file = filter->stats_file;
+  location = g_strdup (filter->stats_location);
+  GST_OBJECT_UNLOCK (filter);
+
+  if (stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE && location &&
+      !filter->stats_saved) {
+    gst_gimp_color_enhance_save_stats (filter, location);
+    filter->stats_saved = TRUE;
+  }
+
+  g_free (location);
+}
+
+static gint
+color_enhance_compare_runs (gconstpointer a, gconstpointer b)
+{
+  const ColorEnhanceStatsRun *ra = (const ColorEnhanceStatsRun *) a;
+  const ColorEnhanceStatsRun *rb = (const ColorEnhanceStatsRun *) b;
+
+  return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Replaces the runs with the ones in the file. They are left empty if the
+ * file can't be read, and every frame is measured.
+ */
+static void
+gst_gimp_color_enhance_load_stats (GstGimpColorEnhance * filter,
+    const gchar * location)
+{
+  gchar *contents;
+  gchar **lines;
+  GError *error = NULL;
+  guint count, i, line;
+
+  g_array_set_size (filter->stats_runs, 0);
+
+  if (!g_file_get_contents (location, &contents, NULL, &error)) {
+    GST_ELEMENT_WARNING (filter, RESOURCE, READ,
+        ("Could not load statistics from %s", location),
+        ("%s", error->message));
+    g_error_free (error);
+    return;
+  }
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  /* Skip comments */
+  for (line = 0; lines[line] && lines[line][0] == '#'; line++);
+
+  if (!lines[line] || sscanf (lines[line], "%u", &count) != 1) {
+    GST_WARNING_OBJECT (filter, "malformed statistics file header");
+    goto done;
+  }
+
+  for (i = 0, line++; i < count && lines[line]; i++, line++) {
+    ColorEnhanceStatsRun run;
+    guint64 start;
+    guint vlo, vhi;
+
+    if (sscanf (lines[line], "%" G_GUINT64_FORMAT " %u %u", &start, &vlo,
+            &vhi) != 3 || vlo > 255 || vhi > 255) {
+      GST_WARNING_OBJECT (filter, "invalid statistics entry: %s", lines[line]);
+      g_array_set_size (filter->stats_runs, 0);
+      goto done;
+    }
+
+    run.start = start;
+    run.vlo = vlo;
+    run.vhi = vhi;
+    g_array_append_val (filter->stats_runs, run);
+  }
+
+  /* An analyze pass with seeks may have written them out of order */
+  g_array_sort (filter->stats_runs, color_enhance_compare_runs);
+
+  GST_DEBUG_OBJECT (filter, "loaded %u ranges", filter->stats_runs->len);
+
+done:
+  g_strfreev (lines);
+}
+
+/* Find the range of the run the frame at timestamp belongs to */
+static gboolean
+gst_gimp_color_enhance_lookup_range (GstGimpColorEnhance * filter,
+    GstClockTime timestamp, ColorEnhanceParam_t * param)
+{
+  const ColorEnhanceStatsRun *runs =
+      (const ColorEnhanceStatsRun *) filter->stats_runs->data;
+  guint lo = 0, hi = filter->stats_runs->len;
+
+  if (!GST_CLOCK_TIME_IS_VALID (timestamp) || hi == 0 ||
+      timestamp < runs[0].start)
+    return FALSE;
+
+  /* The last run starting at or before timestamp */
+  while (hi - lo > 1) {
+    guint mid = (lo + hi) / 2;
+
+    if (runs[mid].start <= timestamp)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  param->vlo = runs[lo].vlo;
+  param->vhi = runs[lo].vhi;
+  return TRUE;
+}
+
+/* The statistics file is written at EOS, from the streaming thread, so it is
+ * complete when the pipeline posts EOS.
+ */
+static gboolean
+gst_gimp_color_enhance_sink_event (GstPad * pad, GstEvent * event)
+{
+  GstGimpColorEnhance *filter;
+  gboolean ret;
+
+  filter = GST_GIMPCOLORENHANCE (gst_pad_get_parent (pad));
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_EOS)
+    gst_gimp_color_enhance_finish_stats (filter);
+
+  ret = gst_pad_event_default (pad, event);
+
+  gst_object_unref (filter);
+  return ret;
+}
 
 /* chain function
  * this function does the actual processing
@@ -478,73 +1856,144 @@ static GstFlowReturn
 gst_gimp_color_enhance_chain (GstPad * pad, GstBuffer * buf)
 {
   GstGimpColorEnhance *filter;
-  GstBuffer *hsvbuf;
-  guint8 *data, *hsvdata;
-  
+  GstBuffer *outbuf;
+  GstFlowReturn ret;
+  guint8 *data, *outdata;
+  ColorEnhanceBand *bands;
+  gint n_bands, max_bands;
+  GstGimpColorEnhanceStatsFile stats_file;
+  gboolean load_stats = FALSE;
+  gchar *location = NULL;
 
-  ColorEnhanceParam_t param;
-  gint x, y, hsvx;
-  gint bytes_x, bytes_x_hsvk;
+  ColorEnhanceParam_t param, applied;
 
 
   filter = GST_GIMPCOLORENHANCE (GST_OBJECT_PARENT (pad));
 
+  /* The threads property may change during the frame, so it is read once */
+  max_bands = MAX (1, (gint) filter->threads);
+  bands = g_new (ColorEnhanceBand, max_bands);
+
+  /* The statistics file settings may change while playing, so they are
+   * copied, and only used from the copy */
+  GST_OBJECT_LOCK (filter);
+  stats_file = filter->stats_file;
+  if (stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_APPLY &&
+      !filter->stats_loaded) {
+    filter->stats_loaded = TRUE;
+    load_stats = TRUE;
+    location = g_strdup (filter->stats_location);
+  }
+  GST_OBJECT_UNLOCK (filter);
+
+  if (load_stats) {
+    if (location)
+      gst_gimp_color_enhance_load_stats (filter, location);
+    else
+      g_array_set_size (filter->stats_runs, 0);
+    g_free (location);
+  }
 
-  buf = gst_buffer_make_writable (buf);
-  hsvbuf = gst_buffer_new_and_alloc(filter->width * filter->height * 4);
+  if (stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_APPLY &&
+      gst_gimp_color_enhance_lookup_range (filter, GST_BUFFER_TIMESTAMP (buf),
+          &param)) {
+    /* The range is known, a single pass in place */
+    buf = gst_buffer_make_writable (buf);
+    data = GST_BUFFER_DATA (buf);
+    n_bands = color_enhance_split (filter, bands, max_bands, data, data);
 
-  data = GST_BUFFER_DATA (buf);
-  hsvdata = GST_BUFFER_DATA (hsvbuf);
+    color_enhance_set_pass (filter, bands, n_bands, FALSE, TRUE, param.vlo,
+        param.vhi);
+    color_enhance_run_bands (filter, bands, n_bands);
 
-  /* Convert color space first, for speed. */
+    g_free (bands);
 
-  bytes_x = filter->width * 3;
-  bytes_x_hsvk = filter->width * 4;
+    filter->prev_vlo = param.vlo;
+    filter->prev_vhi = param.vhi;
+    filter->have_prev_range = TRUE;
 
-  hsvx = 0;
-  for(y=0; y<filter->height; y++) {
-    for(x=0; x<bytes_x; x+=3, hsvx+=4) {
-      colorspace_prepare (data + y*bytes_x + x, hsvdata + y*bytes_x_hsvk + hsvx);
-    }
-    hsvx = 0;
+    return gst_pad_push (filter->srcpad, buf);
   }
 
-  /* Find vhi and vlo. */
-  memset(&param, 0, sizeof(ColorEnhanceParam_t));
+  if (filter->stats_source == GST_GIMP_COLOR_ENHANCE_STATS_CURRENT ||
+      !filter->have_prev_range) {
+    /* Two passes over the frame, in place */
+    buf = gst_buffer_make_writable (buf);
+    data = GST_BUFFER_DATA (buf);
+    n_bands = color_enhance_split (filter, bands, max_bands, data, data);
 
-  for(y=0; y<filter->height; y++) {
-    for(x=0; x<bytes_x_hsvk; x+=4) {
-      find_vhi_vlo (hsvdata + y*bytes_x_hsvk + x, (gpointer)(&param));
-    }
-  }
+    color_enhance_set_pass (filter, bands, n_bands, TRUE, FALSE, 0, 0);
+    color_enhance_run_bands (filter, bands, n_bands);
+    color_enhance_reduce (filter, bands, n_bands, &param);
 
-  /* Run the actual enhancement. */
-  
-  for(y=0; y<filter->height; y++) {
-    for(x=0; x<bytes_x_hsvk; x+=4) {
-      enhance_it (hsvdata + y*bytes_x_hsvk + x, hsvdata + y*bytes_x_hsvk + x, param.vlo,
-                  param.vhi);
-    }
+    color_enhance_set_pass (filter, bands, n_bands, FALSE, TRUE, param.vlo,
+        param.vhi);
+    color_enhance_run_bands (filter, bands, n_bands);
+
+    g_free (bands);
+
+    if (stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE)
+      gst_gimp_color_enhance_record_range (filter, GST_BUFFER_TIMESTAMP (buf),
+          &param);
+
+    filter->prev_vlo = param.vlo;
+    filter->prev_vhi = param.vhi;
+    filter->have_prev_range = TRUE;
+
+    return gst_pad_push (filter->srcpad, buf);
   }
 
-  /* Convert colorspace back to RGB. */
+  /* Single pass with the range of the previous frame. The input is kept, so
+   * the frame can be enhanced again if the range turns out to be too far off.
+   */
+  ret = gst_pad_alloc_buffer_and_set_caps (filter->srcpad,
+      GST_BUFFER_OFFSET (buf), GST_BUFFER_SIZE (buf), GST_BUFFER_CAPS (buf),
+      &outbuf);
+  if (ret != GST_FLOW_OK) {
+    g_free (bands);
+    gst_buffer_unref (buf);
+    return ret;
+  }
+  gst_buffer_copy_metadata (outbuf, buf, GST_BUFFER_COPY_TIMESTAMPS);
 
-  hsvx = 0;
-  for(y=0; y<filter->height; y++) {
-    for(x=0; x<bytes_x; x+=3, hsvx+=4) {
-      colorspace_prepare_reverse (hsvdata + y*bytes_x_hsvk + hsvx, data + y*bytes_x + x);
-    }
-    hsvx = 0;
+  data = GST_BUFFER_DATA (buf);
+  outdata = GST_BUFFER_DATA (outbuf);
+  n_bands = color_enhance_split (filter, bands, max_bands, data, outdata);
+
+  color_enhance_set_pass (filter, bands, n_bands, TRUE, TRUE, filter->prev_vlo,
+      filter->prev_vhi);
+  color_enhance_run_bands (filter, bands, n_bands);
+  color_enhance_reduce (filter, bands, n_bands, &param);
+  applied.vlo = filter->prev_vlo;
+  applied.vhi = filter->prev_vhi;
+
+  if (ABS (param.vhi - filter->prev_vhi) > filter->scene_cut_threshold ||
+      ABS (param.vlo - filter->prev_vlo) > filter->scene_cut_threshold) {
+    GST_DEBUG_OBJECT (filter, "scene cut, range %d-%d -> %d-%d",
+        filter->prev_vlo, filter->prev_vhi, param.vlo, param.vhi);
+    color_enhance_set_pass (filter, bands, n_bands, FALSE, TRUE, param.vlo,
+        param.vhi);
+    color_enhance_run_bands (filter, bands, n_bands);
+    applied = param;
   }
 
+  g_free (bands);
+
+  if (stats_file == GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE)
+    gst_gimp_color_enhance_record_range (filter, GST_BUFFER_TIMESTAMP (buf),
+        &applied);
+
+  filter->prev_vlo = param.vlo;
+  filter->prev_vhi = param.vhi;
+
 /*
   if (filter->silent == FALSE)
     g_print ("I'm plugged, therefore I'm in.\n");
 */
 
-  gst_buffer_unref (hsvbuf);
+  gst_buffer_unref (buf);
 
-  return gst_pad_push (filter->srcpad, buf);
+  return gst_pad_push (filter->srcpad, outbuf);
 }
 
 
@@ -24,6 +24,62 @@
 
 #include <gst/gst.h>
 
+/* Which frame the value range is measured on */
+typedef enum {
+  GST_GIMP_COLOR_ENHANCE_STATS_CURRENT,  /* The frame being enhanced, needs two
+                                          * passes over it */
+  GST_GIMP_COLOR_ENHANCE_STATS_PREVIOUS  /* The previous frame, so the range of
+                                          * the current one can be measured
+                                          * while enhancing it */
+} GstGimpColorEnhanceStatsSource;
+
+/* Negotiated video format */
+typedef enum {
+  GST_GIMP_COLOR_ENHANCE_FORMAT_RGB,
+  GST_GIMP_COLOR_ENHANCE_FORMAT_I420,
+  GST_GIMP_COLOR_ENHANCE_FORMAT_AYUV
+} GstGimpColorEnhanceFormat;
+
+/* What the statistics file is used for */
+typedef enum {
+  GST_GIMP_COLOR_ENHANCE_STATS_FILE_OFF,     /* Not used */
+  GST_GIMP_COLOR_ENHANCE_STATS_FILE_ANALYZE, /* Record the applied ranges */
+  GST_GIMP_COLOR_ENHANCE_STATS_FILE_APPLY    /* Apply the recorded ranges */
+} GstGimpColorEnhanceStatsFile;
+
+/* Frames from start on, up to the next run, use the same value range */
+typedef struct {
+  GstClockTime start;
+  guint8 vlo, vhi;
+} ColorEnhanceStatsRun;
+
+/* How the transform for a value range is cached */
+typedef enum {
+  GST_GIMP_COLOR_ENHANCE_LUT_NONE,        /* Compute every pixel */
+  GST_GIMP_COLOR_ENHANCE_LUT_TETRAHEDRAL, /* Interpolate in a sampled 3D LUT */
+  GST_GIMP_COLOR_ENHANCE_LUT_EXACT        /* Remember computed colors */
+} GstGimpColorEnhanceLutMode;
+
+/* Nodes on each axis of the interpolated LUT */
+#define COLOR_ENHANCE_LUT_NODES 33
+
+/* The exact mode cache has 2^COLOR_ENHANCE_LUT_EXACT_BITS slots */
+#define COLOR_ENHANCE_LUT_EXACT_BITS 16
+
+/* Number of value ranges whose LUTs are kept */
+#define COLOR_ENHANCE_LUT_CACHE 4
+
+/* Size of the chunks the single pass mode measures and enhances in turn, in
+ * pixels. Small enough to stay in the cache between the two steps.
+ */
+#define COLOR_ENHANCE_CHUNK 4096
+
+/* Number of separate histograms consecutive pixels are counted in */
+#define COLOR_ENHANCE_HIST_LANES 4
+
+/* Upper limit of the threads property */
+#define COLOR_ENHANCE_MAX_THREADS 64
+
 G_BEGIN_DECLS
 
 /* #defines don't like whitespacey bits */
@@ -49,6 +105,40 @@ struct _GstGimpColorEnhance
 
   gboolean silent;
   gint width, height;
+  GstGimpColorEnhanceFormat format;
+
+  GstGimpColorEnhanceStatsSource stats_source;
+  gint scene_cut_threshold;
+
+  /* Clip percentiles of the value range */
+  gdouble low_percentile, high_percentile;
+
+  /* Only every stats_stride-th pixel of every stats_stride-th row is
+   * measured */
+  guint stats_stride;
+
+  /* Value range of the previous frame */
+  gboolean have_prev_range;
+  guint8 prev_vlo, prev_vhi;
+
+  /* Value ranges recorded in or loaded from stats_location, in the order of
+   * their start */
+  GstGimpColorEnhanceStatsFile stats_file;
+  gchar *stats_location;
+  GArray *stats_runs;
+  gboolean stats_loaded;
+  gboolean stats_saved;      /* The recorded runs are in the file */
+
+  /* LUTs of recently used value ranges, most recent first */
+  GstGimpColorEnhanceLutMode lut_mode;
+  GQueue *luts;
+
+  /* Row bands are processed by the pool if there is more than one thread */
+  guint threads;
+  GThreadPool *pool;
+  GMutex *lock;
+  GCond *bands_done;
+  gint bands_pending;
 };
 
 struct _GstGimpColorEnhanceClass 
@@ -0,0 +1,116 @@
+/*
+ * SIMD kernels for the GIMP contrast stretch filter
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* The stretch of a channel is y * 255 / d, where y is the component minus
+ * lo, clamped to [0, d], and d is hi - lo. SSE2 has no byte table lookup, so
+ * the division is done as a multiplication by m = ceil(255 * 2^16 / d) on
+ * 16-bit lanes, with the high and low 16 bits of m multiplied separately:
+ *
+ *   y * m >> 16 = y * (m >> 16) + (y * (m & 0xffff) >> 16)
+ *
+ * This is exact: the error of the quotient is below y / 2^16, which is less
+ * than 1 / d, the smallest distance of a non-integer quotient from an
+ * integer.
+ *
+ * 16 pixels are three vectors. Byte i of the block belongs to channel i % 3,
+ * so the parameters of each vector are laid out once per call.
+ */
+
+#include "contraststretchsimd.h"
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+gint
+contrast_stretch_rgb_simd (const guint8 *src,
+                           guint8       *dest,
+                           gint          n_pixels,
+                           const guint8 *lo,
+                           const guint8 *hi)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  guint8 lo8[48], range8[48];
+  guint16 mhi[48], mlo[48];
+  __m128i vlo[3], vrange[3], vmhi[6], vmlo[6];
+  gint i, k;
+
+  for (i = 0; i < 48; i++) {
+    gint c = i % 3;
+    guint32 m;
+
+    if (hi[c] != lo[c]) {
+      lo8[i] = lo[c];
+      range8[i] = hi[c] - lo[c];
+      m = (255 * 65536 + range8[i] - 1) / range8[i];
+    } else {
+      /* Copy: y * 1 */
+      lo8[i] = 0;
+      range8[i] = 255;
+      m = 65536;
+    }
+    mhi[i] = m >> 16;
+    mlo[i] = m & 0xffff;
+  }
+
+  for (k = 0; k < 3; k++) {
+    vlo[k] = _mm_loadu_si128 ((const __m128i *) (lo8 + k * 16));
+    vrange[k] = _mm_loadu_si128 ((const __m128i *) (range8 + k * 16));
+  }
+  for (k = 0; k < 6; k++) {
+    vmhi[k] = _mm_loadu_si128 ((const __m128i *) (mhi + k * 8));
+    vmlo[k] = _mm_loadu_si128 ((const __m128i *) (mlo + k * 8));
+  }
+
+  for (i = 0; i + CONTRAST_STRETCH_SIMD_BLOCK <= n_pixels;
+      i += CONTRAST_STRETCH_SIMD_BLOCK) {
+    for (k = 0; k < 3; k++) {
+      __m128i x, y, ylo, yhi, olo, ohi;
+
+      x = _mm_loadu_si128 ((const __m128i *) (src + i * 3 + k * 16));
+      y = _mm_min_epu8 (_mm_subs_epu8 (x, vlo[k]), vrange[k]);
+
+      ylo = _mm_unpacklo_epi8 (y, zero);
+      yhi = _mm_unpackhi_epi8 (y, zero);
+      olo = _mm_add_epi16 (_mm_mullo_epi16 (ylo, vmhi[k * 2]),
+          _mm_mulhi_epu16 (ylo, vmlo[k * 2]));
+      ohi = _mm_add_epi16 (_mm_mullo_epi16 (yhi, vmhi[k * 2 + 1]),
+          _mm_mulhi_epu16 (yhi, vmlo[k * 2 + 1]));
+
+      _mm_storeu_si128 ((__m128i *) (dest + i * 3 + k * 16),
+          _mm_packus_epi16 (olo, ohi));
+    }
+  }
+
+  return i;
+}
+
+#else
+
+gint
+contrast_stretch_rgb_simd (const guint8 *src,
+                           guint8       *dest,
+                           gint          n_pixels,
+                           const guint8 *lo,
+                           const guint8 *hi)
+{
+  return 0;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * SIMD kernels for the GIMP contrast stretch filter
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef CONTRASTSTRETCHSIMD_H
+#define CONTRASTSTRETCHSIMD_H
+
+#include <glib.h>
+
+/* Pixels handled by one iteration of the kernel */
+#define CONTRAST_STRETCH_SIMD_BLOCK 16
+
+/* Stretch each channel c of packed RGB pixels from src from [lo[c], hi[c]]
+ * to [0, 255], clamping values outside of the range, and store them to dest,
+ * which may be the same as src. lo[c] must not be above hi[c], and channels
+ * with lo[c] == hi[c] are copied. The result is bit-exact with the stretch
+ * tables of the element. Only whole blocks are processed, so the number of
+ * processed pixels is returned and the rest is left to the caller.
+ */
+gint contrast_stretch_rgb_simd (const guint8 *src,
+                                guint8       *dest,
+                                gint          n_pixels,
+                                const guint8 *lo,
+                                const guint8 *hi);
+
+#endif
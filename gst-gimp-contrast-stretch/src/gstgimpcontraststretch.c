@@ -34,6 +34,48 @@
  * conversion from the enhancement itself. This makes it possible to remove a
  * redundant conversion pass.
  *
+ * The saturation and value ranges only depend on the largest and smallest
+ * component of each pixel, so they are measured without a color space
+ * conversion, and the frame is stretched in a single pass that converts to
+ * HSV and back. Frames whose ranges are already full are passed through
+ * untouched.
+ *
+ * Measuring the ranges of every frame makes the stretch flicker. With
+ * temporal=true, the bounds are kept across frames instead. Each frame is
+ * only sampled sparsely: the bounds follow the sampled ranges smoothly, and
+ * only change when they move more than the hysteresis. When the value
+ * histograms of consecutive samples differ more than cut-threshold, the
+ * frame is taken as a scene cut and its ranges are measured exactly.
+ *
+ * For frames with both deep shadows and bright highlights, tiles=N stretches
+ * each tile of an NxN grid with its own bounds. Each pixel blends the tables
+ * of the four nearest tiles bilinearly, so tile borders don't show. The
+ * tiles are measured and the rows stretched by the number of threads given.
+ * Each frame's tiles are measured afresh, so the temporal property and its
+ * settings don't apply with tiles above 1.
+ *
+ * Letterbox bars, logos and borders pull the bounds to the ends of the
+ * range. The roi-x, roi-y, roi-width and roi-height properties limit the
+ * measurement to a rectangle, while the whole frame is still stretched. The
+ * rectangle can also be changed between frames with a serialized custom
+ * downstream event named "gimpcontraststretch-roi", with integer x, y, width
+ * and height fields.
+ *
+ * With mode=rgb, the element does the GIMP's per channel "Stretch Contrast"
+ * instead: each RGB channel is stretched to the full range separately. This
+ * shifts hues, but is much cheaper, and is done with SSE2 where available.
+ *
+ * With mode=equalize, the value channel is equalized instead of stretched:
+ * the histogram of values gathered in the statistics pass is turned into a
+ * table through its cumulative distribution, and applied in the same pass
+ * as the saturation stretch. The temporal and tiles properties don't apply
+ * to this mode.
+ *
+ * With analyze-only=true, the frames are only read. The saturation and value
+ * ranges of the ROI are posted as "gimpcontraststretch" element messages with
+ * timestamp, slo, shi, vlo and vhi fields, and the buffers are pushed
+ * unchanged, without a copy.
+ *
  * The original description of the ported GIMP plugin "Autostretch HSV 0.10" by
  * Scott Goehring and Federico Mena Quintero is the following.
  *
@@ -62,6 +104,7 @@
 #include <gst/gst.h>
 
 #include "gstgimpcontraststretch.h"
+#include "contraststretchsimd.h"
 
 #include <string.h>
 
@@ -78,9 +121,43 @@ enum
 enum
 {
   PROP_0,
-  PROP_SILENT
+  PROP_SILENT,
+  PROP_MODE,
+  PROP_TEMPORAL,
+  PROP_SMOOTHING,
+  PROP_HYSTERESIS,
+  PROP_CUT_THRESHOLD,
+  PROP_TILES,
+  PROP_THREADS,
+  PROP_ROI_X,
+  PROP_ROI_Y,
+  PROP_ROI_WIDTH,
+  PROP_ROI_HEIGHT,
+  PROP_ANALYZE_ONLY
 };
 
+#define GST_TYPE_GIMPCONTRASTSTRETCH_MODE \
+  (gst_gimpcontraststretch_mode_get_type ())
+static GType
+gst_gimpcontraststretch_mode_get_type (void)
+{
+  static GType mode_type = 0;
+  static const GEnumValue modes[] = {
+    {GST_GIMPCONTRASTSTRETCH_MODE_HSV,
+        "Stretch saturation and value, keeping hue", "hsv"},
+    {GST_GIMPCONTRASTSTRETCH_MODE_RGB,
+        "Stretch each RGB channel separately", "rgb"},
+    {GST_GIMPCONTRASTSTRETCH_MODE_EQUALIZE,
+        "Equalize value and stretch saturation, keeping hue", "equalize"},
+    {0, NULL, NULL}
+  };
+
+  if (!mode_type) {
+    mode_type = g_enum_register_static ("GstgimpcontraststretchMode", modes);
+  }
+  return mode_type;
+}
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
@@ -104,9 +181,14 @@ static void gst_gimpcontraststretch_set_property (GObject * object, guint prop_i
     const GValue * value, GParamSpec * pspec);
 static void gst_gimpcontraststretch_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_gimpcontraststretch_finalize (GObject * object);
 
 static gboolean gst_gimpcontraststretch_set_caps (GstPad * pad, GstCaps * caps);
 static GstFlowReturn gst_gimpcontraststretch_chain (GstPad * pad, GstBuffer * buf);
+static gboolean gst_gimpcontraststretch_sink_event (GstPad * pad,
+    GstEvent * event);
+static GstStateChangeReturn gst_gimpcontraststretch_change_state (
+    GstElement * element, GstStateChange transition);
 
 /* GObject vmethod implementations */
 
@@ -139,10 +221,51 @@ gst_gimpcontraststretch_class_init (GstgimpcontraststretchClass * klass)
 
   gobject_class->set_property = gst_gimpcontraststretch_set_property;
   gobject_class->get_property = gst_gimpcontraststretch_get_property;
+  gobject_class->finalize = gst_gimpcontraststretch_finalize;
+  gstelement_class->change_state = gst_gimpcontraststretch_change_state;
 
   g_object_class_install_property (gobject_class, PROP_SILENT,
       g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
           FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MODE,
+      g_param_spec_enum ("mode", "Mode", "Space the histograms are stretched in",
+          GST_TYPE_GIMPCONTRASTSTRETCH_MODE, GST_GIMPCONTRASTSTRETCH_MODE_HSV,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TEMPORAL,
+      g_param_spec_boolean ("temporal", "Temporal", "Keep the saturation and value bounds across frames, and only measure them again on scene cuts (hsv mode, without tiles)",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SMOOTHING,
+      g_param_spec_double ("smoothing", "Smoothing", "Weight of the previous bounds when following the sampled ones in temporal mode",
+          0.0, 1.0, 0.9, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_HYSTERESIS,
+      g_param_spec_uint ("hysteresis", "Hysteresis", "Smallest change of a bound that is applied in temporal mode",
+          0, 255, 2, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_CUT_THRESHOLD,
+      g_param_spec_double ("cut-threshold", "Cut threshold", "L1 distance of the normalized value histograms of consecutive frames that is taken as a scene cut in temporal mode",
+          0.0, 2.0, 0.5, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TILES,
+      g_param_spec_uint ("tiles", "Tiles", "Stretch each tile of an NxN grid with its own bounds, blending between neighbouring tiles (hsv mode). 1 stretches the whole frame with the same bounds. The tiles are measured on every frame, and temporal doesn't apply.",
+          1, CONTRAST_STRETCH_MAX_TILES, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads", "Number of threads the tiles and rows of the local mode are split between. The result does not depend on it.",
+          1, CONTRAST_STRETCH_MAX_THREADS, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ROI_X,
+      g_param_spec_int ("roi-x", "ROI x", "Left edge of the area the bounds are measured in",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ROI_Y,
+      g_param_spec_int ("roi-y", "ROI y", "Top edge of the area the bounds are measured in",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ROI_WIDTH,
+      g_param_spec_int ("roi-width", "ROI width", "Width of the area the bounds are measured in, 0 to measure the whole frame",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ROI_HEIGHT,
+      g_param_spec_int ("roi-height", "ROI height", "Height of the area the bounds are measured in, 0 to measure the whole frame",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ANALYZE_ONLY,
+      g_param_spec_boolean ("analyze-only", "Analyze only", "Post the saturation and value ranges of each frame as element messages, and pass the frames through unchanged",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 /* initialize the new element
@@ -161,6 +284,8 @@ gst_gimpcontraststretch_init (Gstgimpcontraststretch * filter,
                                 GST_DEBUG_FUNCPTR(gst_pad_proxy_getcaps));
   gst_pad_set_chain_function (filter->sinkpad,
                               GST_DEBUG_FUNCPTR(gst_gimpcontraststretch_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gimpcontraststretch_sink_event));
 
   filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
   gst_pad_set_getcaps_function (filter->srcpad,
@@ -169,6 +294,38 @@ gst_gimpcontraststretch_init (Gstgimpcontraststretch * filter,
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
   filter->silent = FALSE;
+  filter->mode = GST_GIMPCONTRASTSTRETCH_MODE_HSV;
+  filter->analyze_only = FALSE;
+  filter->temporal = FALSE;
+  filter->smoothing = 0.9;
+  filter->hysteresis = 2;
+  filter->cut_threshold = 0.5;
+  filter->have_bounds = FALSE;
+  filter->prev_count = 0;
+  filter->roi_x = 0;
+  filter->roi_y = 0;
+  filter->roi_width = 0;
+  filter->roi_height = 0;
+  filter->tiles = 1;
+  filter->warned_temporal = FALSE;
+  filter->threads = 1;
+  filter->pool = NULL;
+  filter->lock = g_mutex_new ();
+  filter->bands_done = g_cond_new ();
+  filter->bands_pending = 0;
+}
+
+static void
+gst_gimpcontraststretch_finalize (GObject * object)
+{
+  Gstgimpcontraststretch *filter = GST_GIMPCONTRASTSTRETCH (object);
+
+  if (filter->pool)
+    g_thread_pool_free (filter->pool, FALSE, TRUE);
+  g_cond_free (filter->bands_done);
+  g_mutex_free (filter->lock);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 static void
@@ -181,6 +338,48 @@ gst_gimpcontraststretch_set_property (GObject * object, guint prop_id,
     case PROP_SILENT:
       filter->silent = g_value_get_boolean (value);
       break;
+    case PROP_MODE:
+      filter->mode = g_value_get_enum (value);
+      break;
+    case PROP_ANALYZE_ONLY:
+      filter->analyze_only = g_value_get_boolean (value);
+      break;
+    case PROP_TEMPORAL:
+      filter->temporal = g_value_get_boolean (value);
+      filter->have_bounds = FALSE;
+      filter->warned_temporal = FALSE;
+      break;
+    case PROP_SMOOTHING:
+      filter->smoothing = g_value_get_double (value);
+      break;
+    case PROP_HYSTERESIS:
+      filter->hysteresis = g_value_get_uint (value);
+      break;
+    case PROP_CUT_THRESHOLD:
+      filter->cut_threshold = g_value_get_double (value);
+      break;
+    case PROP_TILES:
+      filter->tiles = g_value_get_uint (value);
+      filter->warned_temporal = FALSE;
+      break;
+    case PROP_ROI_X:
+      filter->roi_x = g_value_get_int (value);
+      break;
+    case PROP_ROI_Y:
+      filter->roi_y = g_value_get_int (value);
+      break;
+    case PROP_ROI_WIDTH:
+      filter->roi_width = g_value_get_int (value);
+      break;
+    case PROP_ROI_HEIGHT:
+      filter->roi_height = g_value_get_int (value);
+      break;
+    case PROP_THREADS:
+      filter->threads = g_value_get_uint (value);
+      if (filter->pool)
+        g_thread_pool_set_max_threads (filter->pool,
+            MAX (1, filter->threads - 1), NULL);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -197,6 +396,42 @@ gst_gimpcontraststretch_get_property (GObject * object, guint prop_id,
     case PROP_SILENT:
       g_value_set_boolean (value, filter->silent);
       break;
+    case PROP_MODE:
+      g_value_set_enum (value, filter->mode);
+      break;
+    case PROP_ANALYZE_ONLY:
+      g_value_set_boolean (value, filter->analyze_only);
+      break;
+    case PROP_TEMPORAL:
+      g_value_set_boolean (value, filter->temporal);
+      break;
+    case PROP_SMOOTHING:
+      g_value_set_double (value, filter->smoothing);
+      break;
+    case PROP_HYSTERESIS:
+      g_value_set_uint (value, filter->hysteresis);
+      break;
+    case PROP_CUT_THRESHOLD:
+      g_value_set_double (value, filter->cut_threshold);
+      break;
+    case PROP_TILES:
+      g_value_set_uint (value, filter->tiles);
+      break;
+    case PROP_ROI_X:
+      g_value_set_int (value, filter->roi_x);
+      break;
+    case PROP_ROI_Y:
+      g_value_set_int (value, filter->roi_y);
+      break;
+    case PROP_ROI_WIDTH:
+      g_value_set_int (value, filter->roi_width);
+      break;
+    case PROP_ROI_HEIGHT:
+      g_value_set_int (value, filter->roi_height);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint (value, filter->threads);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -205,6 +440,66 @@ gst_gimpcontraststretch_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+static GstStateChangeReturn
+gst_gimpcontraststretch_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  Gstgimpcontraststretch *filter = GST_GIMPCONTRASTSTRETCH (element);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      /* A new stream, don't carry the bounds over */
+      filter->have_bounds = FALSE;
+      filter->prev_count = 0;
+      break;
+    default:
+      break;
+  }
+
+  return GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+}
+
+/* Take the area to measure from a custom event sent downstream to the sink
+ * pad, as a "gimpcontraststretch-roi" structure with integer x, y, width and
+ * height fields. Being serialized, it applies from the next buffer on.
+ */
+static gboolean
+gst_gimpcontraststretch_sink_event (GstPad * pad, GstEvent * event)
+{
+  Gstgimpcontraststretch *filter;
+  const GstStructure *structure;
+  gboolean ret;
+
+  filter = GST_GIMPCONTRASTSTRETCH (gst_pad_get_parent (pad));
+
+  structure = gst_event_get_structure (event);
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_DOWNSTREAM && structure &&
+      gst_structure_has_name (structure, "gimpcontraststretch-roi")) {
+    gint x, y, width, height;
+
+    if (gst_structure_get_int (structure, "x", &x) &&
+        gst_structure_get_int (structure, "y", &y) &&
+        gst_structure_get_int (structure, "width", &width) &&
+        gst_structure_get_int (structure, "height", &height)) {
+      GST_DEBUG_OBJECT (filter, "ROI %dx%d at %d,%d", width, height, x, y);
+      filter->roi_x = MAX (x, 0);
+      filter->roi_y = MAX (y, 0);
+      filter->roi_width = MAX (width, 0);
+      filter->roi_height = MAX (height, 0);
+    } else {
+      GST_WARNING_OBJECT (filter, "malformed ROI event");
+    }
+
+    gst_event_unref (event);
+    ret = TRUE;
+  } else {
+    ret = gst_pad_event_default (pad, event);
+  }
+
+  gst_object_unref (filter);
+  return ret;
+}
+
 /* this function handles the link with other elements */
 static gboolean
 gst_gimpcontraststretch_set_caps (GstPad * pad, GstCaps * caps)
@@ -391,99 +686,746 @@ typedef struct {
   guint8 vlo;
 } AutostretchData;
 
-static void
-find_max (guchar *src, AutostretchData *data)
+/* Add the saturation and value of an RGB pixel to the range, and return
+ * the value. Both only depend on the largest and smallest component, so the
+ * hue isn't computed.
+ */
+static inline guint8
+range_add (const guint8 *src, AutostretchData *data)
 {
-  guint8 s, v;
+  guint8 min, max, s;
 
-  s = src[1];
-  v = src[2];
+  max = MAX (MAX (src[0], src[1]), src[2]);
+  min = MIN (MIN (src[0], src[1]), src[2]);
+
+  /* Same as gimp_rgb_to_hsv4 */
+  s = max ? (max - min) * 255 / max : 0;
 
   if (s > data->shi) data->shi = s;
   if (s < data->slo) data->slo = s;
-  if (v > data->vhi) data->vhi = v;
-  if (v < data->vlo) data->vlo = v;
+  if (max > data->vhi) data->vhi = max;
+  if (max < data->vlo) data->vlo = max;
+
+  return max;
 }
 
+/* Find the saturation and value range of n_pixels RGB pixels */
 static void
-autostretch_hsv_func (guchar *src, guchar *dest,
-		      AutostretchData *data)
+find_range (const guint8 *src, gint n_pixels, AutostretchData *data)
 {
-  gint s, v;
+  gint i;
 
-  s = src[1];
-  v = src[2];  
+  for (i = 0; i < n_pixels; i++, src += 3)
+    range_add (src, data);
+}
 
-  if (data->shi != data->slo)
-    s = (s - data->slo) * 255 / (data->shi - data->slo);
-  if (data->vhi != data->vlo)
-    v = (v - data->vlo) * 255 / (data->vhi - data->vlo);
+/* Pixels [x0, x1) of rows [y0, y1) */
+typedef struct {
+  gint x0, y0, x1, y1;
+} ContrastStretchRect;
 
-  dest[0] = src[0]; /* Don't touch hue */
-  dest[1] = s;
-  dest[2] = v;
+/* Find the saturation and value range of the pixels in rect */
+static void
+find_range_rect (const guint8 *src, gint width,
+    const ContrastStretchRect *rect, AutostretchData *data)
+{
+  gint y;
+
+  for (y = rect->y0; y < rect->y1; y++)
+    find_range (src + (y * width + rect->x0) * 3, rect->x1 - rect->x0, data);
 }
 
+/* Find the range of every step-th pixel of every step-th row of rect, and
+ * count their values in vhist. Returns the number of pixels counted.
+ */
+static guint
+sample_range (const guint8 *src, gint width, const ContrastStretchRect *rect,
+    gint step, guint32 *vhist, AutostretchData *data)
+{
+  guint count = 0;
+  gint x, y;
 
+  memset (vhist, 0, 256 * sizeof (guint32));
 
-/* chain function
- * this function does the actual processing
+  for (y = rect->y0; y < rect->y1; y += step)
+    for (x = rect->x0; x < rect->x1; x += step, count++)
+      vhist[range_add (src + (y * width + x) * 3, data)]++;
+
+  return count;
+}
+
+/* L1 distance of two histograms normalized to 1, between 0 and 2 */
+static gdouble
+histogram_distance (const guint32 *a, guint na, const guint32 *b, guint nb)
+{
+  gdouble d = 0.0;
+  gint i;
+
+  for (i = 0; i < 256; i++)
+    d += ABS ((gdouble) a[i] / na - (gdouble) b[i] / nb);
+
+  return d;
+}
+
+/* Fill lut with the stretch of [lo, hi] to [0, 255], or the identity if the
+ * range is a single value or empty */
+static void
+autostretch_prepare (guint8 *lut, guint8 lo, guint8 hi)
+{
+  gint i;
+
+  for (i = 0; i < 256; i++) {
+    if (hi > lo)
+      lut[i] = CLAMP (i - lo, 0, hi - lo) * 255 / (hi - lo);
+    else
+      lut[i] = i;
+  }
+}
+
+/* Convert to HSV, stretch saturation and value and convert back, one pixel
+ * at a time. src and dest may be the same.
  */
-static GstFlowReturn
-gst_gimpcontraststretch_chain (GstPad * pad, GstBuffer * buf)
+static void
+autostretch_hsv_pixels (const guint8 *src, guint8 *dest, gint n_pixels,
+    const guint8 *slut, const guint8 *vlut)
 {
-  Gstgimpcontraststretch *filter;
+  guint8 h, s, v;
+  gint i;
+
+  for (i = 0; i < n_pixels; i++, src += 3, dest += 3) {
+    gimp_rgb_to_hsv4 (src, &h, &s, &v);
+    gimp_hsv_to_rgb4 (dest, h, slut[s], vlut[v]); /* Don't touch hue */
+  }
+}
+
+
+
+/* The area to measure, clipped to the frame */
+static void
+gst_gimpcontraststretch_get_roi (Gstgimpcontraststretch * filter,
+    ContrastStretchRect * rect)
+{
+  rect->x0 = MIN (filter->roi_x, filter->width);
+  rect->y0 = MIN (filter->roi_y, filter->height);
+  /* Clamp the size rather than the sum, which overflows for sizes near
+   * G_MAXINT meaning "to the edge" */
+  rect->x1 = rect->x0 + MIN (filter->roi_width, filter->width - rect->x0);
+  rect->y1 = rect->y0 + MIN (filter->roi_height, filter->height - rect->y0);
+
+  if (rect->x1 <= rect->x0 || rect->y1 <= rect->y0) {
+    rect->x0 = 0;
+    rect->y0 = 0;
+    rect->x1 = filter->width;
+    rect->y1 = filter->height;
+  }
+}
+
+
+
+/* Temporal mode */
+
+/* Start over from the exact range of a frame */
+static void
+gst_gimpcontraststretch_reset_bounds (Gstgimpcontraststretch * filter,
+    const AutostretchData * range)
+{
+  guint8 measured[4] = { range->slo, range->shi, range->vlo, range->vhi };
+  gint k;
+
+  for (k = 0; k < 4; k++) {
+    filter->smoothed[k] = measured[k];
+    filter->bounds[k] = measured[k];
+  }
+  filter->have_bounds = TRUE;
+}
+
+/* Follow the range of a sample of the frame */
+static void
+gst_gimpcontraststretch_follow_bounds (Gstgimpcontraststretch * filter,
+    const AutostretchData * range)
+{
+  guint8 measured[4] = { range->slo, range->shi, range->vlo, range->vhi };
+  gint k, b;
+
+  for (k = 0; k < 4; k++) {
+    filter->smoothed[k] = filter->smoothing * filter->smoothed[k] +
+        (1.0 - filter->smoothing) * measured[k];
+
+    b = ROUND (filter->smoothed[k]);
+    if (ABS (b - filter->bounds[k]) > filter->hysteresis)
+      filter->bounds[k] = b;
+  }
+
+  /* A low bound moving past a high one that stayed */
+  for (k = 0; k < 4; k += 2)
+    if (filter->bounds[k] > filter->bounds[k + 1]) {
+      filter->bounds[k] = ROUND (filter->smoothed[k]);
+      filter->bounds[k + 1] = ROUND (filter->smoothed[k + 1]);
+    }
+}
+
+/* Find the bounds to stretch the frame with. The frame is only read in full
+ * on scene cuts.
+ */
+static void
+gst_gimpcontraststretch_temporal_range (Gstgimpcontraststretch * filter,
+    const guint8 * data, const ContrastStretchRect * roi,
+    AutostretchData * param)
+{
+  guint32 hist[256];
+  AutostretchData sampled = { 0, 255, 0, 255 };
+  guint count;
+  gboolean cut;
+
+  count = sample_range (data, filter->width, roi,
+      CONTRAST_STRETCH_SAMPLE_STEP, hist, &sampled);
+
+  cut = !filter->have_bounds || count == 0 || filter->prev_count == 0 ||
+      histogram_distance (hist, count, filter->prev_hist,
+      filter->prev_count) > filter->cut_threshold;
+
+  memcpy (filter->prev_hist, hist, sizeof (hist));
+  filter->prev_count = count;
+
+  if (cut) {
+    AutostretchData exact = { 0, 255, 0, 255 };
+
+    find_range_rect (data, filter->width, roi, &exact);
+    gst_gimpcontraststretch_reset_bounds (filter, &exact);
+    GST_DEBUG_OBJECT (filter, "scene cut, s %d-%d, v %d-%d", exact.slo,
+        exact.shi, exact.vlo, exact.vhi);
+  } else {
+    gst_gimpcontraststretch_follow_bounds (filter, &sampled);
+  }
+
+  param->slo = filter->bounds[0];
+  param->shi = filter->bounds[1];
+  param->vlo = filter->bounds[2];
+  param->vhi = filter->bounds[3];
+}
+
+
+
+/* Local mode
+ *
+ * The frame is split into a grid of tiles, and each tile gets its own
+ * saturation and value tables from its own bounds. A pixel is stretched
+ * through the tables of the four tiles whose centers surround it, weighted
+ * bilinearly by its distance from the centers, so there are no seams at the
+ * tile borders.
+ */
+
+typedef struct {
+  gint n;                   /* Tiles on each axis */
+  gint width, height;
+  gint *col_start, *row_start; /* n + 1 entries each */
+  AutostretchData *range;   /* n * n entries, row by row */
+  guint8 (*slut)[256];
+  guint8 (*vlut)[256];
+
+  /* Left or upper tile to blend from and the weight of the next one, out of
+   * 256, for each column and row */
+  gint *col_tile, *col_weight;
+  gint *row_tile, *row_weight;
+
+  ContrastStretchRect roi;  /* Pixels counted in the tile ranges */
+} ContrastStretchTiles;
+
+/* Fill the tile and weight of each of the size positions along an axis */
+static void
+tiles_axis (const gint *start, gint n, gint size, gint *tile, gint *weight)
+{
+  gint i = 0, p;
+
+  for (p = 0; p < size; p++) {
+    /* Positions and centers are doubled to stay integer */
+    gint pos = 2 * p;
+
+    while (i < n - 2 && pos >= start[i + 1] + start[i + 2] - 1)
+      i++;
+
+    if (pos <= start[0] + start[1] - 1) {
+      tile[p] = 0;
+      weight[p] = 0;
+    } else if (pos >= start[n - 1] + start[n] - 1) {
+      tile[p] = n - 2;
+      weight[p] = 256;
+    } else {
+      gint c0 = start[i] + start[i + 1] - 1;
+      gint c1 = start[i + 1] + start[i + 2] - 1;
+
+      tile[p] = i;
+      weight[p] = (pos - c0) * 256 / (c1 - c0);
+    }
+  }
+}
+
+static ContrastStretchTiles *
+tiles_new (gint width, gint height, gint n)
+{
+  ContrastStretchTiles *tiles = g_new0 (ContrastStretchTiles, 1);
+  gint i;
+
+  tiles->n = n;
+  tiles->width = width;
+  tiles->height = height;
+  tiles->col_start = g_new (gint, n + 1);
+  tiles->row_start = g_new (gint, n + 1);
+  for (i = 0; i <= n; i++) {
+    tiles->col_start[i] = width * i / n;
+    tiles->row_start[i] = height * i / n;
+  }
+
+  tiles->range = g_new (AutostretchData, n * n);
+  tiles->slut = g_malloc (n * n * 256);
+  tiles->vlut = g_malloc (n * n * 256);
+
+  tiles->col_tile = g_new (gint, width);
+  tiles->col_weight = g_new (gint, width);
+  tiles->row_tile = g_new (gint, height);
+  tiles->row_weight = g_new (gint, height);
+  tiles_axis (tiles->col_start, n, width, tiles->col_tile, tiles->col_weight);
+  tiles_axis (tiles->row_start, n, height, tiles->row_tile, tiles->row_weight);
+
+  return tiles;
+}
+
+static void
+tiles_free (ContrastStretchTiles *tiles)
+{
+  g_free (tiles->col_start);
+  g_free (tiles->row_start);
+  g_free (tiles->range);
+  g_free (tiles->slut);
+  g_free (tiles->vlut);
+  g_free (tiles->col_tile);
+  g_free (tiles->col_weight);
+  g_free (tiles->row_tile);
+  g_free (tiles->row_weight);
+  g_free (tiles);
+}
+
+/* Measure the part of tile t inside the ROI and build its tables. A tile
+ * outside of the ROI is left unstretched.
+ */
+static void
+tiles_measure (ContrastStretchTiles *tiles, const guint8 *data, gint t)
+{
+  AutostretchData *range = &tiles->range[t];
+  gint tx = t % tiles->n, ty = t / tiles->n;
+  ContrastStretchRect rect;
+
+  rect.x0 = MAX (tiles->col_start[tx], tiles->roi.x0);
+  rect.y0 = MAX (tiles->row_start[ty], tiles->roi.y0);
+  rect.x1 = MIN (tiles->col_start[tx + 1], tiles->roi.x1);
+  rect.y1 = MIN (tiles->row_start[ty + 1], tiles->roi.y1);
+
+  range->shi = 0;
+  range->slo = 255;
+  range->vhi = 0;
+  range->vlo = 255;
+
+  if (rect.x1 > rect.x0)
+    find_range_rect (data, tiles->width, &rect, range);
+
+  autostretch_prepare (tiles->slut[t], range->slo, range->shi);
+  autostretch_prepare (tiles->vlut[t], range->vlo, range->vhi);
+}
+
+/* Blend the tables of the four tiles around a pixel */
+static inline guint8
+tiles_blend (guint8 (*lut)[256], gint t00, gint t01, gint t10, gint t11,
+    gint wx, gint wy, guint8 i)
+{
+  gint top = lut[t00][i] * (256 - wx) + lut[t01][i] * wx;
+  gint bottom = lut[t10][i] * (256 - wx) + lut[t11][i] * wx;
+
+  return (top * (256 - wy) + bottom * wy + 32768) >> 16;
+}
+
+/* Stretch rows [first, last) in place */
+static void
+tiles_apply (ContrastStretchTiles *tiles, guint8 *data, gint first, gint last)
+{
+  gint n = tiles->n;
+  gint x, y;
+
+  for (y = first; y < last; y++) {
+    gint t0 = tiles->row_tile[y] * n, t1 = t0 + n;
+    gint wy = tiles->row_weight[y];
+    guint8 *p = data + y * tiles->width * 3;
+
+    for (x = 0; x < tiles->width; x++, p += 3) {
+      gint tx = tiles->col_tile[x], wx = tiles->col_weight[x];
+      guint8 h, s, v;
+
+      gimp_rgb_to_hsv4 (p, &h, &s, &v);
+      s = tiles_blend (tiles->slut, t0 + tx, t0 + tx + 1, t1 + tx,
+          t1 + tx + 1, wx, wy, s);
+      v = tiles_blend (tiles->vlut, t0 + tx, t0 + tx + 1, t1 + tx,
+          t1 + tx + 1, wx, wy, v);
+      gimp_hsv_to_rgb4 (p, h, s, v);
+    }
+  }
+}
+
+/* A share of the work of one pass */
+typedef struct {
+  gboolean measure;              /* Measure tiles, or stretch rows */
+  ContrastStretchTiles *tiles;
   guint8 *data;
+  gint first, last;              /* Tiles or rows */
+} ContrastStretchBand;
 
-  AutostretchData param;
+static void
+contrast_stretch_band (ContrastStretchBand *band)
+{
+  gint t;
 
-  gint x, y, idx;
+  if (band->measure) {
+    for (t = band->first; t < band->last; t++)
+      tiles_measure (band->tiles, band->data, t);
+  } else {
+    tiles_apply (band->tiles, band->data, band->first, band->last);
+  }
+}
 
-  filter = GST_GIMPCONTRASTSTRETCH (GST_OBJECT_PARENT (pad));
+static void
+contrast_stretch_band_thread (gpointer data, gpointer user_data)
+{
+  Gstgimpcontraststretch *filter = GST_GIMPCONTRASTSTRETCH (user_data);
+
+  contrast_stretch_band ((ContrastStretchBand *) data);
+
+  g_mutex_lock (filter->lock);
+  if (--filter->bands_pending == 0)
+    g_cond_signal (filter->bands_done);
+  g_mutex_unlock (filter->lock);
+}
+
+/* Split count tiles or rows between the threads and process them, the first
+ * share in the calling thread. Returns when all are done.
+ */
+static void
+contrast_stretch_run (Gstgimpcontraststretch *filter,
+                      ContrastStretchTiles   *tiles,
+                      guint8                 *data,
+                      gboolean                measure,
+                      gint                    count)
+{
+  ContrastStretchBand *bands;
+  gint n_bands = MAX (1, MIN ((gint) filter->threads, count));
+  gint b;
+
+  bands = g_new (ContrastStretchBand, n_bands);
+  for (b = 0; b < n_bands; b++) {
+    bands[b].measure = measure;
+    bands[b].tiles = tiles;
+    bands[b].data = data;
+    bands[b].first = count * b / n_bands;
+    bands[b].last = count * (b + 1) / n_bands;
+  }
+
+  if (n_bands > 1 && filter->pool == NULL) {
+    filter->pool = g_thread_pool_new (contrast_stretch_band_thread, filter,
+        MAX (1, filter->threads - 1), FALSE, NULL);
+  }
+
+  if (n_bands == 1 || filter->pool == NULL) {
+    for (b = 0; b < n_bands; b++)
+      contrast_stretch_band (&bands[b]);
+    g_free (bands);
+    return;
+  }
+
+  filter->bands_pending = n_bands - 1;
+  for (b = 1; b < n_bands; b++)
+    g_thread_pool_push (filter->pool, &bands[b], NULL);
+
+  contrast_stretch_band (&bands[0]);
+
+  g_mutex_lock (filter->lock);
+  while (filter->bands_pending > 0)
+    g_cond_wait (filter->bands_done, filter->lock);
+  g_mutex_unlock (filter->lock);
+
+  g_free (bands);
+}
+
+/* Stretch with n x n tiles, n >= 2 */
+static GstFlowReturn
+gst_gimpcontraststretch_local (Gstgimpcontraststretch * filter, GstBuffer * buf,
+    gint n)
+{
+  ContrastStretchTiles *tiles;
+  guint8 *data;
 
   buf = gst_buffer_make_writable (buf);
   data = GST_BUFFER_DATA (buf);
 
+  tiles = tiles_new (filter->width, filter->height, n);
+  gst_gimpcontraststretch_get_roi (filter, &tiles->roi);
+  contrast_stretch_run (filter, tiles, data, TRUE, n * n);
+  contrast_stretch_run (filter, tiles, data, FALSE, filter->height);
+  tiles_free (tiles);
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+
+
+/* Per channel stretch, as in the GIMP's "Stretch Contrast" */
 
-  /* To HSV */
+/* Count each channel of the RGB pixels in rect in its own histogram */
+static void
+rgb_histograms (const guint8 *src, gint width, const ContrastStretchRect *rect,
+    guint32 hist[3][256])
+{
+  gint x, y;
 
-  for (y=0; y < filter->height; y++) {
-    for (x=0; x < filter->width * 3; x+=3) {
-      idx = y*filter->width*3 + x;
-      gimp_rgb_to_hsv4(data + idx, data+idx, data + idx + 1, data + idx + 2);
+  memset (hist, 0, 3 * 256 * sizeof (guint32));
+
+  for (y = rect->y0; y < rect->y1; y++) {
+    const guint8 *p = src + (y * width + rect->x0) * 3;
+
+    for (x = rect->x0; x < rect->x1; x++, p += 3) {
+      hist[0][p[0]]++;
+      hist[1][p[1]]++;
+      hist[2][p[2]]++;
     }
   }
+}
 
-  /* Find maximum and minimum values and saturations */
+/* Find the smallest and largest value of a histogram, [0, 255] if empty */
+static void
+histogram_range (const guint32 *hist, guint8 *lo, guint8 *hi)
+{
+  gint l, h;
 
-  memset (&param, 0, sizeof(AutostretchData));
+  for (l = 0; l < 255 && hist[l] == 0; l++);
+  for (h = 255; h > l && hist[h] == 0; h--);
 
-  for (y=0; y < filter->height; y++) {
-    for (x=0; x < filter->width * 3; x+=3) {
-      idx = y*filter->width*3 + x;
-      find_max (data + idx, &param);                     
-    }
+  if (hist[l] == 0) {
+    l = 0;
+    h = 255;
   }
 
+  *lo = l;
+  *hi = h;
+}
 
-  /* Do the actual stretching */
+/* Stretch each channel of n_pixels RGB pixels through its table */
+static void
+autostretch_rgb_pixels (const guint8 *src, guint8 *dest, gint n_pixels,
+    const guint8 *lo, const guint8 *hi, guint8 lut[3][256])
+{
+  gint i;
 
-  for (y=0; y < filter->height; y++) {
-    for (x=0; x < filter->width * 3; x+=3) {
-      idx = y*filter->width*3 + x;
-      autostretch_hsv_func (data + idx, data + idx, &param);
-    }
+  i = contrast_stretch_rgb_simd (src, dest, n_pixels, lo, hi);
+
+  for (; i < n_pixels; i++) {
+    dest[i*3]   = lut[0][src[i*3]];
+    dest[i*3+1] = lut[1][src[i*3+1]];
+    dest[i*3+2] = lut[2][src[i*3+2]];
   }
+}
+
+static GstFlowReturn
+gst_gimpcontraststretch_rgb (Gstgimpcontraststretch * filter, GstBuffer * buf)
+{
+  guint32 hist[3][256];
+  guint8 lo[3], hi[3], lut[3][256];
+  ContrastStretchRect roi;
+  guint8 *data;
+  gint n_pixels, c;
+
+  n_pixels = filter->width * filter->height;
+
+  gst_gimpcontraststretch_get_roi (filter, &roi);
+  rgb_histograms (GST_BUFFER_DATA (buf), filter->width, &roi, hist);
+  for (c = 0; c < 3; c++)
+    histogram_range (hist[c], &lo[c], &hi[c]);
+
+  /* Nothing to stretch */
 
-  /* Back to RGB */
+  if (lo[0] == 0 && hi[0] == 255 && lo[1] == 0 && hi[1] == 255 &&
+      lo[2] == 0 && hi[2] == 255)
+    return gst_pad_push (filter->srcpad, buf);
 
-  for (y=0; y < filter->height; y++) {
-    for (x=0; x < filter->width * 3; x+=3) {
-      idx = y*filter->width*3 + x;
-      gimp_hsv_to_rgb4(data + idx, data[idx], data[idx + 1], data[idx + 2]);
+  for (c = 0; c < 3; c++)
+    autostretch_prepare (lut[c], lo[c], hi[c]);
+
+  buf = gst_buffer_make_writable (buf);
+  data = GST_BUFFER_DATA (buf);
+
+  autostretch_rgb_pixels (data, data, n_pixels, lo, hi, lut);
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+
+
+/* Equalization */
+
+/* Fill lut with the cumulative distribution of the count values in hist,
+ * scaled so that the lowest value maps to 0 and the highest to 255.
+ */
+static void
+equalize_prepare (guint8 *lut, const guint32 *hist, guint count)
+{
+  guint64 cdf = 0, first;
+  gint i;
+
+  for (i = 0; i < 255 && hist[i] == 0; i++);
+  first = hist[i];
+
+  if (first == count) {
+    /* A single value, nothing to spread */
+    for (i = 0; i < 256; i++)
+      lut[i] = i;
+    return;
+  }
+
+  for (i = 0; i < 256; i++) {
+    cdf += hist[i];
+    lut[i] = cdf <= first ? 0 :
+        ((cdf - first) * 255 + (count - first) / 2) / (count - first);
+  }
+}
+
+/* Equalize the value histogram of the ROI and stretch saturation, in the
+ * same passes as the HSV stretch */
+static GstFlowReturn
+gst_gimpcontraststretch_equalize (Gstgimpcontraststretch * filter,
+    GstBuffer * buf)
+{
+  AutostretchData param = { 0, 255, 0, 255 };
+  ContrastStretchRect roi;
+  guint32 hist[256];
+  guint8 slut[256], vlut[256];
+  guint8 *data;
+  guint count;
+
+  gst_gimpcontraststretch_get_roi (filter, &roi);
+  count = sample_range (GST_BUFFER_DATA (buf), filter->width, &roi, 1, hist,
+      &param);
+  if (count == 0)
+    return gst_pad_push (filter->srcpad, buf);
+
+  autostretch_prepare (slut, param.slo, param.shi);
+  equalize_prepare (vlut, hist, count);
+
+  buf = gst_buffer_make_writable (buf);
+  data = GST_BUFFER_DATA (buf);
+
+  autostretch_hsv_pixels (data, data, filter->width * filter->height, slut,
+      vlut);
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+
+
+/* Analysis */
+
+/* Measure the ROI without writing and post the ranges as a
+ * "gimpcontraststretch" element message. The buffer goes on untouched.
+ */
+static GstFlowReturn
+gst_gimpcontraststretch_analyze (Gstgimpcontraststretch * filter,
+    GstBuffer * buf)
+{
+  AutostretchData param = { 0, 255, 0, 255 };
+  ContrastStretchRect roi;
+  GstStructure *s;
+
+  gst_gimpcontraststretch_get_roi (filter, &roi);
+  find_range_rect (GST_BUFFER_DATA (buf), filter->width, &roi, &param);
+
+  s = gst_structure_new ("gimpcontraststretch",
+      "timestamp", G_TYPE_UINT64, GST_BUFFER_TIMESTAMP (buf),
+      "slo", G_TYPE_INT, (gint) param.slo,
+      "shi", G_TYPE_INT, (gint) param.shi,
+      "vlo", G_TYPE_INT, (gint) param.vlo,
+      "vhi", G_TYPE_INT, (gint) param.vhi,
+      NULL);
+
+  gst_element_post_message (GST_ELEMENT (filter),
+      gst_message_new_element (GST_OBJECT (filter), s));
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+
+
+/* chain function
+ * this function does the actual processing
+ */
+static GstFlowReturn
+gst_gimpcontraststretch_chain (GstPad * pad, GstBuffer * buf)
+{
+  Gstgimpcontraststretch *filter;
+  guint8 *data;
+  gint n_pixels;
+
+  AutostretchData param;
+  guint8 slut[256], vlut[256];
+  ContrastStretchRect roi;
+  gint tiles;
+
+  filter = GST_GIMPCONTRASTSTRETCH (GST_OBJECT_PARENT (pad));
+
+  if (filter->analyze_only)
+    return gst_gimpcontraststretch_analyze (filter, buf);
+
+  if (filter->mode == GST_GIMPCONTRASTSTRETCH_MODE_RGB)
+    return gst_gimpcontraststretch_rgb (filter, buf);
+  if (filter->mode == GST_GIMPCONTRASTSTRETCH_MODE_EQUALIZE)
+    return gst_gimpcontraststretch_equalize (filter, buf);
+
+  /* Tiles of at least 2x2 pixels */
+  tiles = MIN ((gint) filter->tiles, MIN (filter->width, filter->height) / 2);
+  if (tiles >= 2) {
+    if (filter->temporal && !filter->warned_temporal) {
+      GST_WARNING_OBJECT (filter, "temporal is ignored with %d tiles", tiles);
+      filter->warned_temporal = TRUE;
     }
+    return gst_gimpcontraststretch_local (filter, buf, tiles);
   }
 
+  n_pixels = filter->width * filter->height;
+
+  /* Find maximum and minimum values and saturations, without writing */
+
+  gst_gimpcontraststretch_get_roi (filter, &roi);
+
+  if (filter->temporal) {
+    gst_gimpcontraststretch_temporal_range (filter, GST_BUFFER_DATA (buf),
+        &roi, &param);
+  } else {
+    param.shi = 0;
+    param.slo = 255;
+    param.vhi = 0;
+    param.vlo = 255;
+    find_range_rect (GST_BUFFER_DATA (buf), filter->width, &roi, &param);
+  }
+
+  /* Nothing to stretch */
+
+  if (param.slo == 0 && param.shi == 255 && param.vlo == 0 &&
+      param.vhi == 255)
+    return gst_pad_push (filter->srcpad, buf);
+
+  /* Stretch while converting to HSV and back */
+
+  autostretch_prepare (slut, param.slo, param.shi);
+  autostretch_prepare (vlut, param.vlo, param.vhi);
+
+  buf = gst_buffer_make_writable (buf);
+  data = GST_BUFFER_DATA (buf);
+
+  autostretch_hsv_pixels (data, data, n_pixels, slut, vlut);
+
   return gst_pad_push (filter->srcpad, buf);
 }
 
@@ -24,6 +24,23 @@
 
 #include <gst/gst.h>
 
+/* Space the histograms are stretched in */
+typedef enum {
+  GST_GIMPCONTRASTSTRETCH_MODE_HSV, /* Saturation and value, keeping hue */
+  GST_GIMPCONTRASTSTRETCH_MODE_RGB,     /* Each RGB channel separately */
+  GST_GIMPCONTRASTSTRETCH_MODE_EQUALIZE /* Equalize value, stretch saturation */
+} GstgimpcontraststretchMode;
+
+/* Temporal mode samples every CONTRAST_STRETCH_SAMPLE_STEP-th pixel of every
+ * CONTRAST_STRETCH_SAMPLE_STEP-th row */
+#define CONTRAST_STRETCH_SAMPLE_STEP 8
+
+/* Upper limit of the tiles property */
+#define CONTRAST_STRETCH_MAX_TILES 16
+
+/* Upper limit of the threads property */
+#define CONTRAST_STRETCH_MAX_THREADS 64
+
 G_BEGIN_DECLS
 
 /* #defines don't like whitespacey bits */
@@ -49,6 +66,42 @@ struct _Gstgimpcontraststretch
 
   gboolean silent;
   gint width, height;
+  GstgimpcontraststretchMode mode;
+
+  /* Only post the ranges as element messages, without changing the frames */
+  gboolean analyze_only;
+
+  /* Bounds kept across frames, in the order slo, shi, vlo, vhi. smoothed
+   * follows the sampled bounds, and the applied bounds only move when it
+   * gets more than hysteresis away from them.
+   */
+  gboolean temporal;
+  gdouble smoothing;
+  guint hysteresis;
+  gdouble cut_threshold;
+  gboolean have_bounds;
+  gdouble smoothed[4];
+  guint8 bounds[4];
+
+  /* Sampled value histogram of the previous frame */
+  guint32 prev_hist[256];
+  guint prev_count;
+
+  /* Area the statistics are gathered in, the whole frame if it has no
+   * pixels */
+  gint roi_x, roi_y, roi_width, roi_height;
+
+  /* Tiles on each axis of the local mode, 1 for a global stretch */
+  guint tiles;
+  gboolean warned_temporal; /* Told that temporal is ignored with tiles */
+
+  /* Tiles and rows are processed by the pool if there is more than one
+   * thread */
+  guint threads;
+  GThreadPool *pool;
+  GMutex *lock;
+  GCond *bands_done;
+  gint bands_pending;
 };
 
 struct _GstgimpcontraststretchClass 
@@ -28,6 +28,41 @@
  * The GIMP. It can be used to reduce speckle noise and salt-pepper noise in
  * image frames.
  *
+ * If the mapsrc pad is linked, a grayscale map is pushed on it for every frame,
+ * with replaced pixels set to 255. With the post-stats property set, an element
+ * message named "gimpdespeckle" is posted for every frame, containing the
+ * number of replaced pixels, the summed dark and bright pixel counts of the
+ * regions, and the mean despeckle radius.
+ *
+ * In approximate median mode, the region is sampled on a grid with a step
+ * that keeps at most DESPECKLE_APPROX_RADIUS samples on each side of the
+ * target pixel, and the result is the exact median of the samples. The
+ * statistics message then also contains "approx-step", the sampling step for
+ * the initial radius, and "approx-rank-stderr", an estimate of the error of
+ * the rank of the sample median as a fraction of the region. It is the
+ * standard error of a sample quantile, 0.5 / sqrt(n), where n is the mean
+ * number of samples actually used in the subsampled regions, after clipping at
+ * the frame edges and excluding dark and bright pixels. It is not a bound:
+ * a region may be arranged so that the samples miss its median by more. The
+ * dark and bright pixel counts are scaled up by the number of pixels each
+ * sample represents, so adaptive mode keeps its behaviour.
+ *
+ * A grayscale mask can be linked to the msink request pad. In that case, only
+ * pixels where the mask is non-zero are filtered, and tiles of the frame
+ * without any such pixel are skipped entirely.
+ *
+ * For defects that stay at the same position, like hot pixels or dust on the
+ * scanner glass, set defect-learn-frames. The first frames are filtered as
+ * usual, and pixels that differ from the median of their region by more than
+ * defect-deviation in at least defect-threshold of them are listed as
+ * defects. Pixels the median merely smooths, like edges and texture, are not
+ * counted. If more than one in DESPECKLE_DEFECT_MAX_SHARE pixels would be
+ * listed, the threshold is raised until the list fits, and a warning is
+ * posted, since the scene is probably not static. Later frames are copied,
+ * and only the listed pixels are filtered, with the initial radius. The list
+ * is saved to defect-map-location if it is set, and can be loaded from there
+ * later with defect-learn-frames set to 0.
+ *
  * The original descripton of Michael Sweet's GIMP plugin is the following.
  * This plug-in selectively performs a median or adaptive box filter on an
  * image.
@@ -45,8 +80,11 @@
 #endif
 
 #include <gst/gst.h>
+#include <gst/base/gstcollectpads.h>
 
+#include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "gstgimpdespeckle.h"
 
@@ -72,9 +110,40 @@ enum
   PROP_ADAPTIVE,
   PROP_RECURSIVE,
   PROP_BLACK_LEVEL,
-  PROP_WHITE_LEVEL
+  PROP_WHITE_LEVEL,
+  PROP_MEDIAN_MODE,
+  PROP_POST_STATS,
+  PROP_DEFECT_LEARN_FRAMES,
+  PROP_DEFECT_THRESHOLD,
+  PROP_DEFECT_DEVIATION,
+  PROP_DEFECT_MAP_LOCATION
 };
 
+#define GST_TYPE_GIMP_DESPECKLE_MEDIAN_MODE \
+  (gst_gimp_despeckle_median_mode_get_type())
+
+static GType
+gst_gimp_despeckle_median_mode_get_type (void)
+{
+  static GType median_mode_type = 0;
+  static const GEnumValue median_modes[] = {
+    {GST_GIMP_DESPECKLE_MEDIAN_LUMINANCE,
+        "Select the pixel with median luminance", "luminance"},
+    {GST_GIMP_DESPECKLE_MEDIAN_PER_CHANNEL,
+        "Compute the median of each channel independently", "per-channel"},
+    {GST_GIMP_DESPECKLE_MEDIAN_APPROXIMATE,
+        "Select the pixel with median luminance from a subsampled region",
+        "approximate"},
+    {0, NULL, NULL}
+  };
+
+  if (!median_mode_type) {
+    median_mode_type = g_enum_register_static ("GstGimpDespeckleMedianMode",
+        median_modes);
+  }
+  return median_mode_type;
+}
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
@@ -91,6 +160,22 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_STATIC_CAPS ("video/x-raw-rgb")
     );
 
+static GstStaticPadTemplate mapsrc_factory = GST_STATIC_PAD_TEMPLATE ("mapsrc",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-raw-gray, "
+        "bpp=(int)8, "
+        "depth=(int)8")
+    );
+
+static GstStaticPadTemplate msink_factory = GST_STATIC_PAD_TEMPLATE ("msink",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("video/x-raw-gray, "
+        "bpp=(int)8, "
+        "depth=(int)8")
+    );
+
 GST_BOILERPLATE (GstGimpDespeckle, gst_gimp_despeckle, GstElement,
     GST_TYPE_ELEMENT);
 
@@ -98,9 +183,20 @@ static void gst_gimp_despeckle_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_gimp_despeckle_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_gimp_despeckle_finalize (GObject * object);
+static void gst_gimp_despeckle_reset_defects (GstGimpDespeckle * filter);
+
+static GstPad *gst_gimp_despeckle_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name);
+static void gst_gimp_despeckle_release_pad (GstElement * element,
+    GstPad * pad);
+static GstStateChangeReturn gst_gimp_despeckle_change_state (
+    GstElement * element, GstStateChange transition);
 
 static gboolean gst_gimp_despeckle_set_caps (GstPad * pad, GstCaps * caps);
 static GstFlowReturn gst_gimp_despeckle_chain (GstPad * pad, GstBuffer * buf);
+static GstFlowReturn gst_gimp_despeckle_collect_func (GstCollectPads * pads,
+    gpointer user_data);
 
 /* GObject vmethod implementations */
 
@@ -117,8 +213,12 @@ gst_gimp_despeckle_base_init (gpointer gclass)
 
   gst_element_class_add_pad_template (element_class,
       gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&mapsrc_factory));
   gst_element_class_add_pad_template (element_class,
       gst_static_pad_template_get (&sink_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&msink_factory));
 }
 
 /* initialize the gimpdespeckle's class */
@@ -133,7 +233,11 @@ gst_gimp_despeckle_class_init (GstGimpDespeckleClass * klass)
 
   gobject_class->set_property = gst_gimp_despeckle_set_property;
   gobject_class->get_property = gst_gimp_despeckle_get_property;
+  gobject_class->finalize = gst_gimp_despeckle_finalize;
 
+  gstelement_class->request_new_pad = gst_gimp_despeckle_request_new_pad;
+  gstelement_class->release_pad = gst_gimp_despeckle_release_pad;
+  gstelement_class->change_state = gst_gimp_despeckle_change_state;
 
   g_object_class_install_property (gobject_class, PROP_SILENT,
       g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
@@ -153,6 +257,26 @@ gst_gimp_despeckle_class_init (GstGimpDespeckleClass * klass)
   g_object_class_install_property (gobject_class, PROP_WHITE_LEVEL,
       g_param_spec_int ("white-level", "White level", "Threshold over which pixels are considered completely bright.",
           0, 255, 248, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEDIAN_MODE,
+      g_param_spec_enum ("median-mode", "Median mode", "How the median of the region is chosen. In luminance mode, the pixel with the median luminance is picked, as in The GIMP. In per-channel mode, the median of the red, green and blue channels is computed independently, which may produce colors not present in the region. From a radius of 3 on, without adaptive, recursive or a mask, these medians are read from histograms updated as the region moves along the row, so the cost grows with the radius instead of its square. In approximate mode, regions larger than the approximation radius of 5 are subsampled, so the cost does not grow with the radius, at the price of an inexact median.",
+          GST_TYPE_GIMP_DESPECKLE_MEDIAN_MODE,
+          GST_GIMP_DESPECKLE_MEDIAN_LUMINANCE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POST_STATS,
+      g_param_spec_boolean ("post-stats", "Post statistics", "If true, post an element message with per-frame statistics: number of replaced pixels, total count of dark and bright pixels found in the regions, and mean despeckle radius. In approximate median mode, the sampling step and an estimate of the standard error of the median rank are also reported.",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEFECT_LEARN_FRAMES,
+      g_param_spec_uint ("defect-learn-frames", "Defect learning frames", "If not 0, filter this many frames as usual while counting how often each pixel is an outlier, then only filter the pixels that were outliers often enough on later frames. Meant for defects at fixed positions, like hot pixels or dust.",
+          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEFECT_THRESHOLD,
+      g_param_spec_double ("defect-threshold", "Defect threshold", "Fraction of the learning frames a pixel has to be an outlier in to be considered a defect.",
+          0.0, 1.0, 0.9, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEFECT_DEVIATION,
+      g_param_spec_int ("defect-deviation", "Defect deviation", "Minimum luminance difference between a pixel and the median of its region for the pixel to count as an outlier while learning defects.",
+          1, 255, 48, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEFECT_MAP_LOCATION,
+      g_param_spec_string ("defect-map-location", "Defect map location", "File the learned defect map is saved to. If defect-learn-frames is 0, the defect map is loaded from this file instead.",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 /* initialize the new element
@@ -176,8 +300,22 @@ gst_gimp_despeckle_init (GstGimpDespeckle * filter,
   gst_pad_set_getcaps_function (filter->srcpad,
                                 GST_DEBUG_FUNCPTR(gst_pad_proxy_getcaps));
 
+  filter->mapsrcpad = gst_pad_new_from_static_template (&mapsrc_factory,
+                                                        "mapsrc");
+  gst_pad_use_fixed_caps (filter->mapsrcpad);
+
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+  gst_element_add_pad (GST_ELEMENT (filter), filter->mapsrcpad);
+
+  /* The mask pad is added to the CollectPads together with the sink pad when
+   * it is requested. Until then, frames go through the chain function.
+   */
+  filter->masksinkpad = NULL;
+  filter->input = gst_collect_pads_new ();
+  gst_collect_pads_set_function (filter->input,
+      GST_DEBUG_FUNCPTR (gst_gimp_despeckle_collect_func), filter);
+  filter->sinkpad_cdata = filter->masksink_cdata = NULL;
 
   filter->silent = FALSE;
   filter->despeckle_radius = 1;
@@ -185,6 +323,43 @@ gst_gimp_despeckle_init (GstGimpDespeckle * filter,
   filter->recursive = FALSE;
   filter->black_level = 7;
   filter->white_level = 248;
+  filter->median_mode = GST_GIMP_DESPECKLE_MEDIAN_LUMINANCE;
+  filter->post_stats = FALSE;
+
+  filter->defect_learn_frames = 0;
+  filter->defect_threshold = 0.9;
+  filter->defect_deviation = 48;
+  filter->defect_map_location = NULL;
+  filter->defect_hits = NULL;
+  filter->defects = NULL;
+  filter->defect_reset = FALSE;
+  gst_gimp_despeckle_reset_defects (filter);
+}
+
+/* Forget the learned or loaded defect map */
+static void
+gst_gimp_despeckle_reset_defects (GstGimpDespeckle * filter)
+{
+  g_free (filter->defect_hits);
+  filter->defect_hits = NULL;
+  filter->defect_frames_seen = 0;
+
+  if (filter->defects)
+    g_array_free (filter->defects, TRUE);
+  filter->defects = NULL;
+  filter->defect_map_tried = FALSE;
+}
+
+static void
+gst_gimp_despeckle_finalize (GObject * object)
+{
+  GstGimpDespeckle *filter = GST_GIMPDESPECKLE (object);
+
+  gst_object_unref (filter->input);
+  gst_gimp_despeckle_reset_defects (filter);
+  g_free (filter->defect_map_location);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 static void
@@ -212,6 +387,32 @@ gst_gimp_despeckle_set_property (GObject * object, guint prop_id,
     case PROP_WHITE_LEVEL:
       filter->white_level = g_value_get_boolean (value);
       break;
+    case PROP_MEDIAN_MODE:
+      filter->median_mode = g_value_get_enum (value);
+      break;
+    case PROP_POST_STATS:
+      filter->post_stats = g_value_get_boolean (value);
+      break;
+    case PROP_DEFECT_LEARN_FRAMES:
+      /* The map may be in use by the streaming thread, which resets it */
+      GST_OBJECT_LOCK (filter);
+      filter->defect_learn_frames = g_value_get_uint (value);
+      filter->defect_reset = TRUE;
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_DEFECT_THRESHOLD:
+      filter->defect_threshold = g_value_get_double (value);
+      break;
+    case PROP_DEFECT_DEVIATION:
+      filter->defect_deviation = g_value_get_int (value);
+      break;
+    case PROP_DEFECT_MAP_LOCATION:
+      GST_OBJECT_LOCK (filter);
+      g_free (filter->defect_map_location);
+      filter->defect_map_location = g_value_dup_string (value);
+      filter->defect_reset = TRUE;
+      GST_OBJECT_UNLOCK (filter);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -243,6 +444,28 @@ gst_gimp_despeckle_get_property (GObject * object, guint prop_id,
     case PROP_WHITE_LEVEL:
       g_value_set_int (value, filter->white_level);
       break;
+    case PROP_MEDIAN_MODE:
+      g_value_set_enum (value, filter->median_mode);
+      break;
+    case PROP_POST_STATS:
+      g_value_set_boolean (value, filter->post_stats);
+      break;
+    case PROP_DEFECT_LEARN_FRAMES:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint (value, filter->defect_learn_frames);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_DEFECT_THRESHOLD:
+      g_value_set_double (value, filter->defect_threshold);
+      break;
+    case PROP_DEFECT_DEVIATION:
+      g_value_set_int (value, filter->defect_deviation);
+      break;
+    case PROP_DEFECT_MAP_LOCATION:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_string (value, filter->defect_map_location);
+      GST_OBJECT_UNLOCK (filter);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -251,6 +474,83 @@ gst_gimp_despeckle_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+static GstPad *
+gst_gimp_despeckle_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name)
+{
+  GstGimpDespeckle *filter = GST_GIMPDESPECKLE (element);
+
+  if (filter->masksinkpad != NULL) {
+    GST_DEBUG_OBJECT (filter, "mask pad already requested");
+    return NULL;
+  }
+
+  filter->masksinkpad = gst_pad_new_from_template (templ, "msink");
+
+  /* From now on, frames are paired with masks by the CollectPads, which
+   * takes over the chain function of the sink pad.
+   */
+  filter->sinkpad_cdata = gst_collect_pads_add_pad (filter->input,
+      filter->sinkpad, sizeof (GstCollectData));
+  filter->masksink_cdata = gst_collect_pads_add_pad (filter->input,
+      filter->masksinkpad, sizeof (GstCollectData));
+
+  gst_element_add_pad (element, filter->masksinkpad);
+
+  return filter->masksinkpad;
+}
+
+static void
+gst_gimp_despeckle_release_pad (GstElement * element, GstPad * pad)
+{
+  GstGimpDespeckle *filter = GST_GIMPDESPECKLE (element);
+
+  if (pad != filter->masksinkpad)
+    return;
+
+  gst_collect_pads_remove_pad (filter->input, filter->masksinkpad);
+  gst_collect_pads_remove_pad (filter->input, filter->sinkpad);
+  filter->sinkpad_cdata = filter->masksink_cdata = NULL;
+
+  /* Back to unmasked filtering */
+  gst_pad_set_chain_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gimp_despeckle_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_pad_event_default));
+
+  filter->masksinkpad = NULL;
+  gst_element_remove_pad (element, pad);
+}
+
+static GstStateChangeReturn
+gst_gimp_despeckle_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstGimpDespeckle *filter = GST_GIMPDESPECKLE (element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      gst_collect_pads_start (filter->input);
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* Stop the CollectPads before the parent, in accordance with the docs */
+      gst_collect_pads_stop (filter->input);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  /* The pads are deactivated now, so the streaming thread is done with the
+   * defect map */
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+    gst_gimp_despeckle_reset_defects (filter);
+
+  return ret;
+}
+
 /* this function handles the link with other elements */
 static gboolean
 gst_gimp_despeckle_set_caps (GstPad * pad, GstCaps * caps)
@@ -259,6 +559,9 @@ gst_gimp_despeckle_set_caps (GstPad * pad, GstCaps * caps)
   GstPad *otherpad;
   GstStructure *capstruct = gst_caps_get_structure (caps, 0);
   const gchar *mimetype;  
+  const GValue *framerate;
+  GstCaps *mapcaps;
+  gint width, height;
 
   mimetype = gst_structure_get_name (capstruct);
   if(strcmp(mimetype, "video/x-raw-rgb") != 0) {
@@ -269,9 +572,28 @@ gst_gimp_despeckle_set_caps (GstPad * pad, GstCaps * caps)
 
   filter = GST_GIMPDESPECKLE (gst_pad_get_parent (pad));
 
+  width = filter->width;
+  height = filter->height;
   gst_structure_get_int (capstruct, "width", &filter->width);
   gst_structure_get_int (capstruct, "height", &filter->height);
 
+  /* Defect positions are only meaningful for one frame size */
+  if (filter->width != width || filter->height != height)
+    gst_gimp_despeckle_reset_defects (filter);
+
+  /* The speckle map has the same geometry and rate as the frames */
+  mapcaps = gst_caps_new_simple ("video/x-raw-gray",
+      "bpp", G_TYPE_INT, 8,
+      "depth", G_TYPE_INT, 8,
+      "width", G_TYPE_INT, filter->width,
+      "height", G_TYPE_INT, filter->height, NULL);
+  framerate = gst_structure_get_value (capstruct, "framerate");
+  if (framerate)
+    gst_structure_set_value (gst_caps_get_structure (mapcaps, 0), "framerate",
+        framerate);
+  gst_pad_set_caps (filter->mapsrcpad, mapcaps);
+  gst_caps_unref (mapcaps);
+
   otherpad = (pad == filter->srcpad) ? filter->sinkpad : filter->srcpad;
   gst_object_unref (filter);
 
@@ -390,6 +712,112 @@ quick_median_select (const guchar **p,
     }
 }
 
+/*
+ * Plain byte version of the Quickselect routine above, used for the
+ * per-channel median. Returns the value of the median element.
+ */
+static guchar
+quick_select_byte (guchar *i,
+                   gint    n)
+{
+  gint low    = 0;
+  gint high   = n - 1;
+  gint median = (low + high) / 2;
+
+  while (TRUE)
+    {
+      gint middle, ll, hh;
+
+      if (high <= low) /* One element only */
+        return i[median];
+
+      if (high == low + 1)
+        {
+          /* Two elements only */
+          if (i[low] > i[high])
+            VALUE_SWAP (i[low], i[high]);
+
+          return i[median];
+        }
+
+      /* Find median of low, middle and high items; swap into position low */
+      middle = (low + high) / 2;
+
+      if (i[middle] > i[high])
+        VALUE_SWAP (i[middle], i[high]);
+
+      if (i[low] > i[high])
+        VALUE_SWAP (i[low], i[high]);
+
+      if (i[middle] > i[low])
+        VALUE_SWAP (i[middle], i[low]);
+
+      /* Swap low item (now in position middle) into position (low+1) */
+      VALUE_SWAP (i[middle], i[low+1]);
+
+      /* Nibble from each end towards middle, swapping items when stuck */
+      ll = low + 1;
+      hh = high;
+
+      while (TRUE)
+        {
+           do ll++;
+           while (i[low] > i[ll]);
+
+           do hh--;
+           while (i[hh]  > i[low]);
+
+           if (hh < ll)
+             break;
+
+           VALUE_SWAP (i[ll], i[hh]);
+        }
+
+      /* Swap middle item (in position low) back into correct position */
+      VALUE_SWAP (i[low], i[hh]);
+
+      /* Re-set active partition */
+      if (hh <= median)
+        low = ll;
+
+      if (hh >= median)
+        high = hh - 1;
+    }
+}
+
+/*
+ * Median of exactly 9 values with a fixed sorting network, from
+ * "Fast median search: an ANSI C implementation" by Nicolas Devillard - 1998.
+ * Public domain. The compare-exchange is done with MIN/MAX, so this is free of
+ * branches, and covers the full 3x3 region of the default radius.
+ */
+#define BYTE_SORT(a,b) \
+  { guchar t = MIN ((a), (b)); (b) = MAX ((a), (b)); (a) = t; }
+
+static inline guchar
+opt_med9_byte (guchar *p)
+{
+  BYTE_SORT (p[1], p[2]); BYTE_SORT (p[4], p[5]); BYTE_SORT (p[7], p[8]);
+  BYTE_SORT (p[0], p[1]); BYTE_SORT (p[3], p[4]); BYTE_SORT (p[6], p[7]);
+  BYTE_SORT (p[1], p[2]); BYTE_SORT (p[4], p[5]); BYTE_SORT (p[7], p[8]);
+  BYTE_SORT (p[0], p[3]); BYTE_SORT (p[5], p[8]); BYTE_SORT (p[4], p[7]);
+  BYTE_SORT (p[3], p[6]); BYTE_SORT (p[1], p[4]); BYTE_SORT (p[2], p[5]);
+  BYTE_SORT (p[4], p[7]); BYTE_SORT (p[4], p[2]); BYTE_SORT (p[6], p[4]);
+  BYTE_SORT (p[4], p[2]);
+
+  return p[4];
+}
+
+static inline guchar
+byte_median (guchar *i,
+             gint    n)
+{
+  if (n == 9)
+    return opt_med9_byte (i);
+
+  return quick_select_byte (i, n);
+}
+
 
 static inline guchar
 pixel_luminance (const guchar *p,
@@ -410,6 +838,429 @@ pixel_luminance (const guchar *p,
     }
 }
 
+/* Per-frame statistics, collected while filtering */
+typedef struct
+{
+  guint64 processed;  /* pixels filtered, i.e. not skipped because of a mask */
+  guint64 replaced;   /* pixels whose value was changed */
+  guint64 hist0;      /* dark pixels seen in the regions, summed */
+  guint64 hist255;    /* bright pixels seen in the regions, summed */
+  guint64 radius_sum; /* sum of the radius used for each pixel */
+  guint64 approx_regions; /* approximate mode: regions that were subsampled */
+  guint64 approx_samples; /* samples used for the median in those regions */
+} DespeckleStats;
+
+/* Sampling step of the approximate median mode for the given radius */
+static inline gint
+despeckle_approx_step (gint radius)
+{
+  return MAX (1, (radius + DESPECKLE_APPROX_RADIUS - 1) /
+                 DESPECKLE_APPROX_RADIUS);
+}
+
+/* Working buffers and settings shared by the filtering functions */
+typedef struct
+{
+  const guchar **buf;       /* pointers to the pixels of the region */
+  guchar        *ibuf;      /* luminance of the pixels in buf */
+  guchar        *cbuf;      /* per-channel mode: box bytes for each channel */
+  guchar         cpixel[4]; /* per-channel mode: the resulting pixel */
+  gint           box;
+  gint           width, height, bpp;
+  guint8         black_level, white_level;
+  gboolean       per_channel, approximate, recursive;
+  guint16       *defect_hits; /* outlier counts, only while learning defects */
+  gint           defect_deviation;
+} DespeckleContext;
+
+static void
+despeckle_context_init (DespeckleContext *ctx,
+                        GstGimpDespeckle *filter,
+                        gint              width,
+                        gint              height,
+                        gint              bpp)
+{
+  ctx->width       = width;
+  ctx->height      = height;
+  ctx->bpp         = bpp;
+  ctx->black_level = filter->black_level;
+  ctx->white_level = filter->white_level;
+  ctx->per_channel =
+      (filter->median_mode == GST_GIMP_DESPECKLE_MEDIAN_PER_CHANNEL);
+  ctx->approximate =
+      (filter->median_mode == GST_GIMP_DESPECKLE_MEDIAN_APPROXIMATE);
+  ctx->recursive   = filter->recursive;
+  ctx->defect_hits = filter->defect_hits;
+  ctx->defect_deviation = filter->defect_deviation;
+
+  ctx->box  = SQR ((2 * filter->despeckle_radius) + 1);
+  /* TODO: possible performance increase if we don't allocate these for every
+   * frame, but just once when setting the despeckle-radius property */
+  ctx->buf  = g_new (const guchar *, ctx->box);
+  ctx->ibuf = g_new (guchar, ctx->box);
+  ctx->cbuf = ctx->per_channel ? g_new (guchar, bpp * ctx->box) : NULL;
+}
+
+static void
+despeckle_context_clear (DespeckleContext *ctx)
+{
+  g_free (ctx->cbuf);
+  g_free (ctx->ibuf);
+  g_free (ctx->buf);
+}
+
+/* Collect the pixels of the region around (x, y) that are neither too dark
+ * nor too bright, and count the others. The vertical extent is given by the
+ * caller, because the main loop only updates it once per row. Returns the
+ * index of the last collected pixel, -1 if there is none.
+ */
+static inline gint
+despeckle_gather (DespeckleContext *ctx,
+                  const guchar     *src,
+                  gint              x,
+                  gint              y,
+                  gint              ymin,
+                  gint              ymax,
+                  gint              radius,
+                  gint             *hist0,
+                  gint             *hist255)
+{
+  gint width  = ctx->width;
+  gint height = ctx->height;
+  gint bpp    = ctx->bpp;
+  gint med    = -1;
+  gint u, v;
+  gint pos;
+
+  if (ctx->approximate)
+    {
+      gint step  = despeckle_approx_step (radius);
+      gint reach = (radius / step) * step;
+      gint scale = SQR (step);
+
+      for (v = y - reach; v <= y + reach; v += step)
+        {
+          if (v < 0 || v >= height)
+            continue;
+
+          for (u = x - reach; u <= x + reach; u += step)
+            {
+              gint value;
+
+              if (u < 0 || u >= width)
+                continue;
+
+              pos = (u + (v * width)) * bpp;
+              value = pixel_luminance (src + pos, bpp);
+
+              if (value > ctx->black_level && value < ctx->white_level)
+                {
+                  med++;
+                  ctx->buf[med]  = src + pos;
+                  ctx->ibuf[med] = value;
+                }
+              else
+                {
+                  if (value <= ctx->black_level)
+                    *hist0 += scale;
+
+                  if (value >= ctx->white_level)
+                    *hist255 += scale;
+                }
+            }
+        }
+    }
+  else
+    {
+      gint xmin = MAX (0, x - radius);
+      gint xmax = MIN (width - 1, x + radius);
+
+      for (v = ymin; v <= ymax; v++)
+        {
+          for (u = xmin; u <= xmax; u++)
+            {
+              gint value;
+
+              pos = (u + (v * width)) * bpp;
+              value = pixel_luminance (src + pos, bpp);
+
+              if (value > ctx->black_level && value < ctx->white_level)
+                {
+                  med++;
+                  if (ctx->per_channel)
+                    {
+                      gint c;
+
+                      for (c = 0; c < bpp; c++)
+                        ctx->cbuf[c * ctx->box + med] = src[pos + c];
+                    }
+                  else
+                    {
+                      ctx->buf[med]  = src + pos;
+                      ctx->ibuf[med] = value;
+                    }
+                }
+              else
+                {
+                  if (value <= ctx->black_level)
+                    (*hist0)++;
+
+                  if (value >= ctx->white_level)
+                    (*hist255)++;
+                }
+            }
+        }
+    }
+
+  return med;
+}
+
+/* Account for the samples a subsampled region's median was taken from */
+static inline void
+despeckle_count_samples (DespeckleContext *ctx,
+                         gint              radius,
+                         gint              med,
+                         DespeckleStats   *stats)
+{
+  if (ctx->approximate && despeckle_approx_step (radius) > 1)
+    {
+      stats->approx_regions++;
+      stats->approx_samples += med + 1;
+    }
+}
+
+/* Write the median pixel to (x, y), and account for it */
+static inline void
+despeckle_write (DespeckleContext *ctx,
+                 guchar           *src,
+                 guchar           *dst,
+                 gint              x,
+                 gint              y,
+                 const guchar     *pixel,
+                 guchar           *map,
+                 gint              map_stride,
+                 DespeckleStats   *stats)
+{
+  gint bpp = ctx->bpp;
+  gint pos = (x + (y * ctx->width)) * bpp;
+
+  /* Only pixels far from the median are defect candidates, not the ones
+   * it merely smooths */
+  if (ctx->defect_hits &&
+      ABS (pixel_luminance (src + pos, bpp) -
+           pixel_luminance (pixel, bpp)) > ctx->defect_deviation)
+    ctx->defect_hits[y * ctx->width + x]++;
+
+  if (memcmp (src + pos, pixel, bpp) != 0)
+    {
+      stats->replaced++;
+      if (map)
+        map[y * map_stride + x] = 255;
+    }
+
+  if (ctx->recursive)
+    memcpy (src+pos, pixel, bpp);
+    //pixel_copy (src + pos, pixel, bpp);
+
+  memcpy (dst+pos, pixel, bpp);
+  //pixel_copy (dst + pos, pixel, bpp);
+}
+
+/* Write the median of the gathered region to (x, y) */
+static inline void
+despeckle_apply (DespeckleContext *ctx,
+                 guchar           *src,
+                 guchar           *dst,
+                 gint              x,
+                 gint              y,
+                 gint              med,
+                 guchar           *map,
+                 gint              map_stride,
+                 DespeckleStats   *stats)
+{
+  gint bpp = ctx->bpp;
+  gint pos = (x + (y * ctx->width)) * bpp;
+
+  if (med < 1)
+    {
+      //pixel_copy (dst + pos, src + pos, bpp);
+      memcpy (dst+pos, src+pos, bpp);
+    }
+  else
+    {
+      const guchar *pixel;
+
+      if (ctx->per_channel)
+        {
+          gint c;
+
+          for (c = 0; c < bpp; c++)
+            ctx->cpixel[c] = byte_median (ctx->cbuf + c * ctx->box, med + 1);
+
+          pixel = ctx->cpixel;
+        }
+      else
+        {
+          pixel = ctx->buf[quick_median_select (ctx->buf, ctx->ibuf, med + 1)];
+        }
+
+      despeckle_write (ctx, src, dst, x, y, pixel, map, map_stride, stats);
+    }
+}
+
+/* Running histograms of the region for the per-channel median. For each
+ * channel, the median found for the previous pixel is kept together with
+ * the number of values below it, and moved from there.
+ */
+typedef struct
+{
+  guint32 hist[4][256];
+  gint    count;        /* pixels between the black and white levels */
+  gint    hist0, hist255;
+  gint    median[4];
+  gint    below[4];     /* values below median */
+} DespeckleHistogram;
+
+/* Add (delta 1) or remove (delta -1) the pixels of column u in rows ymin to
+ * ymax */
+static inline void
+despeckle_histogram_column (DespeckleContext   *ctx,
+                            DespeckleHistogram *h,
+                            const guchar       *src,
+                            gint                u,
+                            gint                ymin,
+                            gint                ymax,
+                            gint                delta)
+{
+  gint bpp = ctx->bpp;
+  gint v, c;
+
+  for (v = ymin; v <= ymax; v++)
+    {
+      const guchar *p = src + (u + (v * ctx->width)) * bpp;
+      gint value = pixel_luminance (p, bpp);
+
+      if (value > ctx->black_level && value < ctx->white_level)
+        {
+          h->count += delta;
+          for (c = 0; c < bpp; c++)
+            {
+              h->hist[c][p[c]] += delta;
+              if (p[c] < h->median[c])
+                h->below[c] += delta;
+            }
+        }
+      else
+        {
+          if (value <= ctx->black_level)
+            h->hist0 += delta;
+
+          if (value >= ctx->white_level)
+            h->hist255 += delta;
+        }
+    }
+}
+
+/* The value of rank (count - 1) / 2 in channel c, as byte_median picks */
+static inline guchar
+despeckle_histogram_median (DespeckleHistogram *h,
+                            gint                c)
+{
+  const guint32 *hist = h->hist[c];
+  gint rank  = (h->count - 1) / 2;
+  gint m     = h->median[c];
+  gint below = h->below[c];
+
+  while (below > rank)
+    {
+      m--;
+      below -= hist[m];
+    }
+
+  while (below + (gint) hist[m] <= rank)
+    {
+      below += hist[m];
+      m++;
+    }
+
+  h->median[c] = m;
+  h->below[c]  = below;
+
+  return m;
+}
+
+/* Per-channel median filter with a fixed radius. Moving along a row, the
+ * column leaving the region is removed from the histograms and the one
+ * entering it is added, so the cost per pixel grows with the diameter
+ * instead of the area. The result is the same as with byte_median. Adaptive
+ * radius, recursion and masks change the region or the source between
+ * pixels, so this is only used without them.
+ */
+static void
+despeckle_median_histogram (DespeckleContext *ctx,
+                            guchar           *src,
+                            guchar           *dst,
+                            gint              radius,
+                            guchar           *map,
+                            gint              map_stride,
+                            DespeckleStats   *stats)
+{
+  DespeckleHistogram *h = g_new (DespeckleHistogram, 1);
+  gint width  = ctx->width;
+  gint height = ctx->height;
+  gint bpp    = ctx->bpp;
+  gint x, y, u;
+
+  for (y = 0; y < height; y++)
+    {
+      gint ymin = MAX (0, y - radius);
+      gint ymax = MIN (height - 1, y + radius);
+
+      memset (h, 0, sizeof (DespeckleHistogram));
+      for (u = 0; u <= MIN (width - 1, radius); u++)
+        despeckle_histogram_column (ctx, h, src, u, ymin, ymax, 1);
+
+      for (x = 0; x < width; x++)
+        {
+          stats->processed++;
+          stats->hist0      += h->hist0;
+          stats->hist255    += h->hist255;
+          stats->radius_sum += radius;
+
+          if (h->count < 2)
+            {
+              gint pos = (x + (y * width)) * bpp;
+
+              memcpy (dst + pos, src + pos, bpp);
+            }
+          else
+            {
+              gint c;
+
+              for (c = 0; c < bpp; c++)
+                ctx->cpixel[c] = despeckle_histogram_median (h, c);
+
+              despeckle_write (ctx, src, dst, x, y, ctx->cpixel, map,
+                               map_stride, stats);
+            }
+
+          if (x - radius >= 0)
+            despeckle_histogram_column (ctx, h, src, x - radius, ymin, ymax,
+                                        -1);
+          if (x + radius + 1 < width)
+            despeckle_histogram_column (ctx, h, src, x + radius + 1, ymin,
+                                        ymax, 1);
+        }
+    }
+
+  g_free (h);
+}
+
+/* If map is not NULL, it receives 255 for every replaced pixel and 0
+ * elsewhere, in rows of map_stride bytes. If mask is not NULL, only pixels
+ * with a non-zero mask value are filtered, the others are left as they are in
+ * dst, which is expected to hold a copy of src.
+ */
 static void
 despeckle_median (guchar   *src,
                   guchar   *dst,
@@ -417,34 +1268,51 @@ despeckle_median (guchar   *src,
                   gint      height,
                   gint      bpp,
                   gboolean  preview,
-                  GstGimpDespeckle *filter)
+                  GstGimpDespeckle *filter,
+                  guchar   *map,
+                  gint      map_stride,
+                  const guchar *mask,
+                  gint      mask_stride,
+                  DespeckleStats *stats)
 {
-  const guchar **buf;
-  guchar        *ibuf;
-  guint          progress;
-  guint          max_progress;
+  DespeckleContext ctx;
   gint           x, y;
-  gint           u, v;
   gint           diameter;
-  gint           box;
-  gint           pos;
+  guchar        *tiles = NULL;
+  gint           tiles_x = 0;
 
   guint8 radius = filter->despeckle_radius;
-  guint8 filter_type = ((guint8)filter->adaptive << 1) |
-                          (guint8)filter->recursive;
-  guint8 black_level = filter->black_level;
-  guint8 white_level = filter->white_level;
-
-  progress     = 0;
-  max_progress = width * height;
+  gboolean adaptive = filter->adaptive;
 
   diameter = (2 * radius) + 1;
-  box      = SQR (diameter);
-  /* TODO: possible performance increase if we don't allocate these for every
-   * frame, but just once when setting the despeckle-radius property */
-  buf      = g_new (const guchar *, box);
-  ibuf     = g_new (guchar, box);
+  despeckle_context_init (&ctx, filter, width, height, bpp);
+
+  if (ctx.per_channel && !adaptive && !ctx.recursive && !mask &&
+      radius >= DESPECKLE_HISTOGRAM_RADIUS)
+    {
+      despeckle_median_histogram (&ctx, src, dst, radius, map, map_stride,
+                                  stats);
+      despeckle_context_clear (&ctx);
+      return;
+    }
+
+  /* Mark the tiles that contain at least one masked pixel */
+  if (mask)
+    {
+      gint tiles_y = (height + DESPECKLE_MASK_TILE - 1) / DESPECKLE_MASK_TILE;
+
+      tiles_x = (width + DESPECKLE_MASK_TILE - 1) / DESPECKLE_MASK_TILE;
+      tiles   = g_new0 (guchar, tiles_x * tiles_y);
 
+      for (y = 0; y < height; y++)
+        {
+          const guchar *mask_row = mask + y * mask_stride;
+          guchar       *tile_row = tiles + (y / DESPECKLE_MASK_TILE) * tiles_x;
+
+          for (x = 0; x < width; x++)
+            tile_row[x / DESPECKLE_MASK_TILE] |= mask_row[x];
+        }
+    }
 
   for (y = 0; y < height; y++)
     {
@@ -453,63 +1321,40 @@ despeckle_median (guchar   *src,
 
       for (x = 0; x < width; x++)
         {
-          gint xmin    = MAX (0, x - radius);
-          gint xmax    = MIN (width - 1, x + radius);
           gint hist0   = 0;
           gint hist255 = 0;
-          gint med     = -1;
+          gint med;
 
-          for (v = ymin; v <= ymax; v++)
+          if (mask)
             {
-              for (u = xmin; u <= xmax; u++)
+              if (!tiles[(y / DESPECKLE_MASK_TILE) * tiles_x +
+                         x / DESPECKLE_MASK_TILE])
                 {
-                  gint value;
-
-                  pos = (u + (v * width)) * bpp;
-                  value = pixel_luminance (src + pos, bpp);
-
-                  if (value > black_level && value < white_level)
-                    {
-                      med++;
-                      buf[med]  = src + pos;
-                      ibuf[med] = value;
-                    }
-                  else
-                    {
-                      if (value <= black_level)
-                        hist0++;
-
-                      if (value >= white_level)
-                        hist255++;
-                    }
+                  /* Skip to the last pixel of the empty tile */
+                  x = MIN (width, (x / DESPECKLE_MASK_TILE + 1) *
+                                  DESPECKLE_MASK_TILE) - 1;
+                  continue;
                 }
-             }
-
-           pos = (x + (y * width)) * bpp;
 
-           if (med < 1)
-             {
-               //pixel_copy (dst + pos, src + pos, bpp);
-               memcpy (dst+pos, src+pos, bpp);
-             }
-           else
-             {
-               const guchar *pixel;
+              if (!mask[y * mask_stride + x])
+                continue;
+            }
 
-               pixel = buf[quick_median_select (buf, ibuf, med + 1)];
+          med = despeckle_gather (&ctx, src, x, y, ymin, ymax, radius,
+                                  &hist0, &hist255);
 
-                if (filter_type & FILTER_RECURSIVE)
-                  memcpy (src+pos, pixel, bpp);
-                  //pixel_copy (src + pos, pixel, bpp);
+          stats->processed++;
+          stats->hist0      += hist0;
+          stats->hist255    += hist255;
+          stats->radius_sum += radius;
+          despeckle_count_samples (&ctx, radius, med, stats);
 
-               memcpy (dst+pos, pixel, bpp);
-               //pixel_copy (dst + pos, pixel, bpp);
-             }
+          despeckle_apply (&ctx, src, dst, x, y, med, map, map_stride, stats);
 
           /*
            * Check the histogram and adjust the diameter accordingly...
            */
-          if (filter_type & FILTER_ADAPTIVE)
+          if (adaptive)
             {
               if (hist0 >= radius || hist255 >= radius)
                 {
@@ -526,10 +1371,370 @@ despeckle_median (guchar   *src,
 
     }
 
-  g_free (ibuf);
-  g_free (buf);
+  g_free (tiles);
+  despeckle_context_clear (&ctx);
 }
 
+/* Filter only the pixels in the defect list. The radius is fixed, since the
+ * adaptive adjustment depends on scanning order.
+ */
+static void
+despeckle_defects (guchar   *src,
+                   guchar   *dst,
+                   gint      width,
+                   gint      height,
+                   gint      bpp,
+                   GstGimpDespeckle *filter,
+                   GArray   *defects,
+                   guchar   *map,
+                   gint      map_stride,
+                   const guchar *mask,
+                   gint      mask_stride,
+                   DespeckleStats *stats)
+{
+  DespeckleContext ctx;
+  gint radius = filter->despeckle_radius;
+  guint i;
+
+  despeckle_context_init (&ctx, filter, width, height, bpp);
+
+  for (i = 0; i < defects->len; i++)
+    {
+      const DespeckleDefect *defect =
+          &g_array_index (defects, DespeckleDefect, i);
+      gint x       = defect->x;
+      gint y       = defect->y;
+      gint hist0   = 0;
+      gint hist255 = 0;
+      gint med;
+
+      if (mask && !mask[y * mask_stride + x])
+        continue;
+
+      med = despeckle_gather (&ctx, src, x, y, MAX (0, y - radius),
+                              MIN (height - 1, y + radius), radius,
+                              &hist0, &hist255);
+
+      stats->processed++;
+      stats->hist0      += hist0;
+      stats->hist255    += hist255;
+      stats->radius_sum += radius;
+      despeckle_count_samples (&ctx, radius, med, stats);
+
+      despeckle_apply (&ctx, src, dst, x, y, med, map, map_stride, stats);
+    }
+
+  despeckle_context_clear (&ctx);
+}
+
+
+static void
+gst_gimp_despeckle_post_stats (GstGimpDespeckle * filter,
+    GstClockTime timestamp, const DespeckleStats * stats)
+{
+  GstStructure *s;
+
+  s = gst_structure_new ("gimpdespeckle",
+      "timestamp", G_TYPE_UINT64, timestamp,
+      "processed", G_TYPE_UINT64, stats->processed,
+      "replaced", G_TYPE_UINT64, stats->replaced,
+      "hist0", G_TYPE_UINT64, stats->hist0,
+      "hist255", G_TYPE_UINT64, stats->hist255,
+      "mean-radius", G_TYPE_DOUBLE,
+          stats->processed ?
+              (gdouble) stats->radius_sum / stats->processed : 0.0,
+      NULL);
+
+  if (filter->median_mode == GST_GIMP_DESPECKLE_MEDIAN_APPROXIMATE) {
+    gint step = despeckle_approx_step (filter->despeckle_radius);
+    gdouble stderr_rank = 0.0;
+
+    /* Regions that were not subsampled have an exact median */
+    if (stats->approx_samples > 0)
+      stderr_rank = 0.5 / sqrt ((gdouble) stats->approx_samples /
+          stats->approx_regions);
+
+    gst_structure_set (s,
+        "approx-step", G_TYPE_INT, step,
+        "approx-rank-stderr", G_TYPE_DOUBLE, stderr_rank,
+        NULL);
+  }
+
+  gst_element_post_message (GST_ELEMENT (filter),
+      gst_message_new_element (GST_OBJECT (filter), s));
+}
+
+/* The defect map file is plain text: a comment line, the frame width, height
+ * and number of defects, then the coordinates of one defect per line.
+ */
+static void
+gst_gimp_despeckle_save_defects (GstGimpDespeckle * filter,
+    const gchar * location)
+{
+  GString *contents;
+  GError *error = NULL;
+  guint i;
+
+  contents = g_string_new ("# gimpdespeckle defect map\n");
+  g_string_append_printf (contents, "%d %d %u\n", filter->width,
+      filter->height, filter->defects->len);
+
+  for (i = 0; i < filter->defects->len; i++) {
+    const DespeckleDefect *defect =
+        &g_array_index (filter->defects, DespeckleDefect, i);
+
+    g_string_append_printf (contents, "%u %u\n", defect->x, defect->y);
+  }
+
+  if (!g_file_set_contents (location, contents->str, contents->len, &error)) {
+    GST_ELEMENT_WARNING (filter, RESOURCE, WRITE,
+        ("Could not save defect map to %s", location),
+        ("%s", error->message));
+    g_error_free (error);
+  }
+
+  g_string_free (contents, TRUE);
+}
+
+/* Returns NULL if the file can't be read, doesn't match the frames, or holds
+ * fewer entries than its header says */
+static GArray *
+gst_gimp_despeckle_load_defects (GstGimpDespeckle * filter,
+    const gchar * location)
+{
+  gchar *contents;
+  gchar **lines;
+  GError *error = NULL;
+  GArray *defects = NULL;
+  gint width, height;
+  guint count, i, line;
+
+  if (!g_file_get_contents (location, &contents, NULL, &error)) {
+    GST_ELEMENT_WARNING (filter, RESOURCE, READ,
+        ("Could not load defect map from %s", location),
+        ("%s", error->message));
+    g_error_free (error);
+    return NULL;
+  }
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  /* Skip comments */
+  for (line = 0; lines[line] && lines[line][0] == '#'; line++);
+
+  if (!lines[line] ||
+      sscanf (lines[line], "%d %d %u", &width, &height, &count) != 3) {
+    GST_WARNING_OBJECT (filter, "malformed defect map header");
+    goto done;
+  }
+
+  if (width != filter->width || height != filter->height) {
+    GST_WARNING_OBJECT (filter, "defect map is for %dx%d frames, ignoring it",
+        width, height);
+    goto done;
+  }
+
+  if (count > (guint) width * height) {
+    GST_WARNING_OBJECT (filter, "defect map claims %u defects, more than "
+        "there are pixels", count);
+    goto done;
+  }
+
+  defects = g_array_sized_new (FALSE, FALSE, sizeof (DespeckleDefect), count);
+
+  for (i = 0, line++; i < count && lines[line]; i++, line++) {
+    DespeckleDefect defect;
+
+    if (sscanf (lines[line], "%u %u", &defect.x, &defect.y) != 2 ||
+        defect.x >= (guint) width || defect.y >= (guint) height) {
+      GST_WARNING_OBJECT (filter, "invalid defect map entry: %s", lines[line]);
+      g_array_free (defects, TRUE);
+      defects = NULL;
+      goto done;
+    }
+
+    g_array_append_val (defects, defect);
+  }
+
+  if (defects->len < count) {
+    GST_WARNING_OBJECT (filter, "defect map is truncated, %u of %u entries",
+        defects->len, count);
+    g_array_free (defects, TRUE);
+    defects = NULL;
+    goto done;
+  }
+
+  GST_DEBUG_OBJECT (filter, "loaded %u defects", defects->len);
+
+done:
+  g_strfreev (lines);
+  return defects;
+}
+
+/* Count a learning frame, whose outliers were counted while filtering, and
+ * build the defect list after the last one. It is saved to location if that
+ * is not NULL.
+ */
+static void
+gst_gimp_despeckle_learn_defects (GstGimpDespeckle * filter,
+    guint learn_frames, const gchar * location)
+{
+  guint n_pixels = filter->width * filter->height;
+  guint max_defects = MAX (1, n_pixels / DESPECKLE_DEFECT_MAX_SHARE);
+  guint *counts;
+  guint threshold, listed, i;
+
+  if (++filter->defect_frames_seen < learn_frames)
+    return;
+
+  /* Number of pixels for each outlier count */
+  counts = g_new0 (guint, filter->defect_frames_seen + 1);
+  for (i = 0; i < n_pixels; i++)
+    counts[filter->defect_hits[i]]++;
+
+  threshold = MAX (1, (guint) ceil (filter->defect_threshold *
+          filter->defect_frames_seen));
+  for (listed = 0, i = threshold; i <= filter->defect_frames_seen; i++)
+    listed += counts[i];
+
+  if (listed > max_defects) {
+    guint found = listed;
+
+    while (listed > max_defects && threshold < filter->defect_frames_seen)
+      listed -= counts[threshold++];
+
+    GST_ELEMENT_WARNING (filter, STREAM, FAILED,
+        ("Too many defects found, the scene is probably not static"),
+        ("%u pixels were outliers often enough, keeping the %u most frequent "
+            "ones", found, MIN (listed, max_defects)));
+  }
+
+  g_free (counts);
+
+  filter->defects = g_array_new (FALSE, FALSE, sizeof (DespeckleDefect));
+
+  for (i = 0; i < n_pixels && filter->defects->len < max_defects; i++)
+    if (filter->defect_hits[i] >= threshold) {
+      DespeckleDefect defect = { i % filter->width, i / filter->width };
+
+      g_array_append_val (filter->defects, defect);
+    }
+
+  g_free (filter->defect_hits);
+  filter->defect_hits = NULL;
+
+  GST_DEBUG_OBJECT (filter, "learned %u defects from %u frames",
+      filter->defects->len, filter->defect_frames_seen);
+
+  if (location)
+    gst_gimp_despeckle_save_defects (filter, location);
+}
+
+/* Filter buf, restricted by maskbuf if it is not NULL, and push the result.
+ * Takes ownership of both buffers.
+ */
+static GstFlowReturn
+gst_gimp_despeckle_process (GstGimpDespeckle * filter, GstBuffer * buf,
+    GstBuffer * maskbuf)
+{
+  GstBuffer *destbuf, *mapbuf = NULL;
+  guint8 *origdata, *newdata, *mapdata = NULL, *maskdata = NULL;
+  gint map_stride;
+  DespeckleStats stats;
+  GstFlowReturn ret;
+  guint learn_frames;
+  gchar *location;
+
+  destbuf = gst_buffer_copy (buf);
+  destbuf = gst_buffer_make_writable (destbuf);
+
+  origdata = GST_BUFFER_DATA (buf);
+  newdata = GST_BUFFER_DATA (destbuf);
+
+  /* Gray rows are padded to 4 bytes */
+  map_stride = GST_ROUND_UP_4 (filter->width);
+
+  if (maskbuf) {
+    if (GST_BUFFER_SIZE (maskbuf) >= map_stride * filter->height) {
+      maskdata = GST_BUFFER_DATA (maskbuf);
+    } else {
+      GST_WARNING_OBJECT (filter, "mask buffer too small (%u), ignoring mask",
+          GST_BUFFER_SIZE (maskbuf));
+    }
+  }
+
+  if (gst_pad_is_linked (filter->mapsrcpad)) {
+    ret = gst_pad_alloc_buffer_and_set_caps (filter->mapsrcpad,
+        GST_BUFFER_OFFSET (buf), map_stride * filter->height,
+        GST_PAD_CAPS (filter->mapsrcpad), &mapbuf);
+
+    if (ret == GST_FLOW_OK) {
+      mapdata = GST_BUFFER_DATA (mapbuf);
+      memset (mapdata, 0, GST_BUFFER_SIZE (mapbuf));
+      gst_buffer_copy_metadata (mapbuf, buf, GST_BUFFER_COPY_TIMESTAMPS);
+    } else {
+      GST_DEBUG_OBJECT (filter, "could not allocate map buffer");
+      mapbuf = NULL;
+    }
+  }
+
+  /* The defect properties may change while the map is in use, so they are
+   * only picked up here */
+  GST_OBJECT_LOCK (filter);
+  if (filter->defect_reset) {
+    gst_gimp_despeckle_reset_defects (filter);
+    filter->defect_reset = FALSE;
+  }
+  learn_frames = filter->defect_learn_frames;
+  location = g_strdup (filter->defect_map_location);
+  GST_OBJECT_UNLOCK (filter);
+
+  if (learn_frames == 0 && location && !filter->defect_map_tried) {
+    filter->defect_map_tried = TRUE;
+    filter->defects = gst_gimp_despeckle_load_defects (filter, location);
+  }
+
+  /* Outliers are counted while filtering the learning frames */
+  if (learn_frames > 0 && filter->defects == NULL &&
+      filter->defect_hits == NULL)
+    filter->defect_hits = g_new0 (guint16, filter->width * filter->height);
+
+  memset (&stats, 0, sizeof (DespeckleStats));
+
+  if (filter->defects) {
+    despeckle_defects (origdata, newdata, filter->width, filter->height, 3,
+                       filter, filter->defects, mapdata, map_stride, maskdata,
+                       map_stride, &stats);
+  } else {
+    despeckle_median (origdata, newdata, filter->width, filter->height, 3,
+                        FALSE, filter, mapdata, map_stride, maskdata,
+                        map_stride, &stats);
+
+    if (learn_frames > 0)
+      gst_gimp_despeckle_learn_defects (filter, learn_frames, location);
+  }
+
+  g_free (location);
+
+  if (filter->post_stats)
+    gst_gimp_despeckle_post_stats (filter, GST_BUFFER_TIMESTAMP (buf), &stats);
+
+  gst_buffer_unref (buf);
+  if (maskbuf)
+    gst_buffer_unref (maskbuf);
+
+  ret = gst_pad_push (filter->srcpad, destbuf);
+
+  if (mapbuf) {
+    GstFlowReturn map_ret = gst_pad_push (filter->mapsrcpad, mapbuf);
+
+    if (map_ret != GST_FLOW_OK)
+      GST_DEBUG_OBJECT (filter, "pushing map failed: %d", map_ret);
+  }
+
+  return ret;
+}
 
 /* chain function
  * this function does the actual processing
@@ -538,22 +1743,39 @@ static GstFlowReturn
 gst_gimp_despeckle_chain (GstPad * pad, GstBuffer * buf)
 {
   GstGimpDespeckle *filter;
-  GstBuffer *destbuf;
-  guint8 *origdata, *newdata;
 
   filter = GST_GIMPDESPECKLE (GST_OBJECT_PARENT (pad));
 
-  destbuf = gst_buffer_copy (buf);
-  destbuf = gst_buffer_make_writable (destbuf);
+  return gst_gimp_despeckle_process (filter, buf, NULL);
+}
 
-  origdata = GST_BUFFER_DATA (buf);
-  newdata = GST_BUFFER_DATA (destbuf);
+/* collect function, used instead of the chain function while the mask pad
+ * exists
+ */
+static GstFlowReturn
+gst_gimp_despeckle_collect_func (GstCollectPads * pads, gpointer user_data)
+{
+  GstGimpDespeckle *filter = GST_GIMPDESPECKLE (user_data);
+  GstBuffer *framebuf, *maskbuf;
 
-  despeckle_median (origdata, newdata, filter->width, filter->height, 3,
-                      FALSE, filter);
+  framebuf = gst_collect_pads_pop (pads, filter->sinkpad_cdata);
+  maskbuf = gst_collect_pads_pop (pads, filter->masksink_cdata);
 
-  gst_buffer_unref (buf);
-  return gst_pad_push (filter->srcpad, destbuf);
+  if (framebuf == NULL) {
+    /* No more frames. The CollectPads eats EOS events, so send them on. */
+    GST_DEBUG_OBJECT (filter, "frame pad is EOS");
+
+    if (maskbuf)
+      gst_buffer_unref (maskbuf);
+
+    gst_pad_push_event (filter->srcpad, gst_event_new_eos ());
+    gst_pad_push_event (filter->mapsrcpad, gst_event_new_eos ());
+
+    return GST_FLOW_UNEXPECTED;
+  }
+
+  /* If the mask pad is EOS, the whole frame is filtered */
+  return gst_gimp_despeckle_process (filter, framebuf, maskbuf);
 }
 
 
@@ -23,11 +23,46 @@
 #define __GST_GIMPDESPECKLE_H__
 
 #include <gst/gst.h>
+#include <gst/base/gstcollectpads.h>
 
 /* Filter type bits */
 #define FILTER_ADAPTIVE 0x2
 #define FILTER_RECURSIVE 0x1
 
+/* Median selection modes */
+typedef enum {
+  GST_GIMP_DESPECKLE_MEDIAN_LUMINANCE,  /* Pick the pixel with median luminance,
+                                         * like The GIMP does */
+  GST_GIMP_DESPECKLE_MEDIAN_PER_CHANNEL, /* Independent median for each
+                                          * channel */
+  GST_GIMP_DESPECKLE_MEDIAN_APPROXIMATE  /* Luminance median of a subsampled
+                                          * region */
+} GstGimpDespeckleMedianMode;
+
+/* In approximate mode, regions are sampled with a step chosen so that at most
+ * this many samples are taken in each direction from the target pixel. Smaller
+ * radii are not subsampled.
+ */
+#define DESPECKLE_APPROX_RADIUS 5
+
+/* From this radius on, per-channel medians are read from running histograms
+ * instead of selecting them from a copy of the region.
+ */
+#define DESPECKLE_HISTOGRAM_RADIUS 3
+
+/* Size of the square tiles checked for being fully outside of the mask */
+#define DESPECKLE_MASK_TILE 16
+
+/* A learned defect map may cover at most one in this many pixels of the
+ * frame. More than that means the scene is not static, and the outliers are
+ * texture rather than defects.
+ */
+#define DESPECKLE_DEFECT_MAX_SHARE 100
+
+/* Position of a pixel in the learned defect map */
+typedef struct {
+  guint x, y;
+} DespeckleDefect;
 
 G_BEGIN_DECLS
 
@@ -51,6 +86,12 @@ struct _GstGimpDespeckle
   GstElement element;
 
   GstPad *sinkpad, *srcpad;
+  GstPad *mapsrcpad; /* Map of replaced pixels, pushed only if linked */
+  GstPad *masksinkpad; /* Optional request pad, NULL if not requested */
+
+  /* Only used while the mask pad exists, to synchronize frames and masks */
+  GstCollectPads *input;
+  GstCollectData *sinkpad_cdata, *masksink_cdata;
 
   gboolean silent;
 
@@ -62,6 +103,22 @@ struct _GstGimpDespeckle
   gboolean recursive;
   guint8 black_level;
   guint8 white_level;
+  GstGimpDespeckleMedianMode median_mode;
+  gboolean post_stats;
+
+  /* Static defect map */
+  guint defect_learn_frames; /* Frames to learn from, 0 if not learning */
+  gdouble defect_threshold;  /* Fraction of learning frames a pixel must be
+                              * an outlier in to be listed as a defect */
+  guint8 defect_deviation;   /* Luminance difference from the median that
+                              * makes a pixel an outlier while learning */
+  gchar *defect_map_location;
+  guint16 *defect_hits;      /* Per-pixel outlier counts while learning */
+  guint defect_frames_seen;
+  GArray *defects;           /* DespeckleDefect, NULL until learned/loaded */
+  gboolean defect_map_tried; /* Loading was already attempted */
+  gboolean defect_reset;     /* The defect properties changed, forget the
+                              * map before the next frame */
 };
 
 struct _GstGimpDespeckleClass 
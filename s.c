@@ -0,0 +1,163 @@
+/*
+ * SIMD kernels for the addalpha element
+ * Copyright (C) 2011 Roland Elek <elek.roland@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Each output pixel is an alpha byte followed by the three bytes of the
+ * input pixel. Four output pixels take twelve frame bytes and four mask
+ * bytes, so a byte shuffle spreads the frame bytes of four pixels over a
+ * vector, leaving every fourth byte zero, and another one puts the alpha
+ * values into those bytes.
+ */
+
+#include "addalphasimd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+/* SSSE3 kernel, 4 pixels per vector */
+
+#define SSSE3 __attribute__ ((target ("ssse3")))
+
+/* Frame bytes 0-11 to output bytes 1-3, 5-7, 9-11 and 13-15 */
+#define FRAME_SHUFFLE_SSSE3 \
+  _mm_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)
+
+/* Mask bytes 4k to 4k+3 to output bytes 0, 4, 8 and 12 */
+#define ALPHA_SHUFFLE_SSSE3(k) \
+  _mm_setr_epi8 (4 * (k), -1, -1, -1, 4 * (k) + 1, -1, -1, -1, \
+      4 * (k) + 2, -1, -1, -1, 4 * (k) + 3, -1, -1, -1)
+
+/* 16 pixels: 48 frame bytes, 16 mask bytes and 64 output bytes */
+static inline SSSE3 void
+add_alpha_16_ssse3 (const guint8 *frame, const guint8 *mask, guint8 *dest)
+{
+  const __m128i fshuf = FRAME_SHUFFLE_SSSE3;
+  __m128i f0, f1, f2, m, px[4];
+  gint k;
+
+  f0 = _mm_loadu_si128 ((const __m128i *) frame);
+  f1 = _mm_loadu_si128 ((const __m128i *) (frame + 16));
+  f2 = _mm_loadu_si128 ((const __m128i *) (frame + 32));
+  m = _mm_loadu_si128 ((const __m128i *) mask);
+
+  /* Frame bytes 0, 12, 24 and 36 at the start of a vector */
+  px[0] = f0;
+  px[1] = _mm_alignr_epi8 (f1, f0, 12);
+  px[2] = _mm_alignr_epi8 (f2, f1, 8);
+  px[3] = _mm_srli_si128 (f2, 4);
+
+  px[0] = _mm_or_si128 (_mm_shuffle_epi8 (px[0], fshuf),
+      _mm_shuffle_epi8 (m, ALPHA_SHUFFLE_SSSE3 (0)));
+  px[1] = _mm_or_si128 (_mm_shuffle_epi8 (px[1], fshuf),
+      _mm_shuffle_epi8 (m, ALPHA_SHUFFLE_SSSE3 (1)));
+  px[2] = _mm_or_si128 (_mm_shuffle_epi8 (px[2], fshuf),
+      _mm_shuffle_epi8 (m, ALPHA_SHUFFLE_SSSE3 (2)));
+  px[3] = _mm_or_si128 (_mm_shuffle_epi8 (px[3], fshuf),
+      _mm_shuffle_epi8 (m, ALPHA_SHUFFLE_SSSE3 (3)));
+
+  for (k = 0; k < 4; k++)
+    _mm_storeu_si128 ((__m128i *) (dest + k * 16), px[k]);
+}
+
+static SSSE3 gint
+add_alpha_ssse3 (const guint8 *frame, const guint8 *mask, guint8 *dest,
+    gint n_pixels)
+{
+  gint i;
+
+  for (i = 0; i + ADD_ALPHA_SIMD_BLOCK <= n_pixels;
+      i += ADD_ALPHA_SIMD_BLOCK) {
+    add_alpha_16_ssse3 (frame + i * 3, mask + i, dest + i * 4);
+    add_alpha_16_ssse3 (frame + i * 3 + 48, mask + i + 16, dest + i * 4 + 64);
+  }
+
+  return i;
+}
+
+/* AVX2 kernel, 8 pixels per vector. Shuffles don't cross the 128-bit
+ * lanes, so each lane gets its own four pixels loaded.
+ */
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+static AVX2 gint
+add_alpha_avx2 (const guint8 *frame, const guint8 *mask, guint8 *dest,
+    gint n_pixels)
+{
+  const __m256i fshuf = _mm256_setr_epi8 (
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m256i ashuf = _mm256_setr_epi8 (
+      0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3, -1, -1, -1,
+      4, -1, -1, -1, 5, -1, -1, -1, 6, -1, -1, -1, 7, -1, -1, -1);
+  gint i, k;
+
+  /* The lanes load 16 bytes for 12, so keep two pixels after the block for
+   * the overlong last load */
+  for (i = 0; i + ADD_ALPHA_SIMD_BLOCK + 2 <= n_pixels;
+      i += ADD_ALPHA_SIMD_BLOCK) {
+    for (k = 0; k < ADD_ALPHA_SIMD_BLOCK; k += 8) {
+      const guint8 *f = frame + (i + k) * 3;
+      __m256i px, a;
+
+      px = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+              _mm_loadu_si128 ((const __m128i *) f)),
+          _mm_loadu_si128 ((const __m128i *) (f + 12)), 1);
+      a = _mm256_broadcastsi128_si256 (
+          _mm_loadl_epi64 ((const __m128i *) (mask + i + k)));
+
+      px = _mm256_or_si256 (_mm256_shuffle_epi8 (px, fshuf),
+          _mm256_shuffle_epi8 (a, ashuf));
+      _mm256_storeu_si256 ((__m256i *) (dest + (i + k) * 4), px);
+    }
+  }
+
+  return i;
+}
+
+AddAlphaSimdFunc
+add_alpha_simd_get_func (const gchar **name)
+{
+  __builtin_cpu_init ();
+
+  if (0) {
+    *name = "avx2";
+    return add_alpha_avx2;
+  }
+
+  if (__builtin_cpu_supports ("ssse3")) {
+    *name = "ssse3";
+    return add_alpha_ssse3;
+  }
+
+  *name = "none";
+  return NULL;
+}
+
+#else
+
+AddAlphaSimdFunc
+add_alpha_simd_get_func (const gchar **name)
+{
+  *name = "none";
+  return NULL;
+}
+
+#endif